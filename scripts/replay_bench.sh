@@ -0,0 +1,74 @@
+#!/bin/sh
+# End to end regression run: replays a capture through driver, decoder and
+# the report nodelet (launch/replay_bench.launch) at 1x, 4x and max rate for
+# 1, 2, 4 and 8 simulated sensors. Writes one json report per run and all of
+# them as a json array into report.json, exits with 1 if any run failed its
+# limits.
+#
+#   replay_bench.sh capture.pcap [output_dir] [duration] [max_latency_us]
+#       [max_drops]
+
+set -e
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 capture.pcap [output_dir] [duration] [max_latency_us]" \
+    "[max_drops]" >&2
+  exit 2
+fi
+
+pcap=$(readlink -f "$1")
+dir=${2:-replay_reports}
+duration=${3:-30}
+max_latency_us=${4:-0}
+max_drops=${5:--1}
+mkdir -p "$dir"
+dir=$(readlink -f "$dir")
+
+rates=${RATES:-"1 4 0"}
+sensors=${SENSORS:-"1 2 4 8"}
+
+for rate in $rates; do
+  for n in $sensors; do
+    output="$dir/rate_${rate}_sensors_${n}.json"
+    echo "pcap_rate $rate, $n sensors -> $output"
+    rm -f "$output"
+    roslaunch velodyne_puck replay_bench.launch pcap:="$pcap" \
+      pcap_rate:="$rate" num_sensors:="$n" duration:="$duration" \
+      output:="$output" max_latency_us:="$max_latency_us" \
+      max_drops:="$max_drops" >"$dir/rate_${rate}_sensors_${n}.log" 2>&1 ||
+      true
+  done
+done
+
+failed=0
+sep=
+{
+  printf '['
+  for rate in $rates; do
+    for n in $sensors; do
+      output="$dir/rate_${rate}_sensors_${n}.json"
+      if [ -f "$output" ]; then
+        printf '%s\n' "$sep"
+        cat "$output"
+        sep=,
+      fi
+    done
+  done
+  printf ']\n'
+} >"$dir/report.json"
+
+for rate in $rates; do
+  for n in $sensors; do
+    output="$dir/rate_${rate}_sensors_${n}.json"
+    if [ ! -f "$output" ]; then
+      echo "FAILED pcap_rate $rate, $n sensors: no report, see log" >&2
+      failed=1
+    elif grep -q '"ok": false' "$output"; then
+      echo "FAILED pcap_rate $rate, $n sensors: limits exceeded" >&2
+      failed=1
+    fi
+  done
+done
+
+echo "Reports in $dir/report.json"
+exit $failed
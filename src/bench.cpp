@@ -0,0 +1,254 @@
+/// Decode throughput benchmark. Runs PacketDecoder and every sweep conversion
+/// on synthetic or recorded packets, without ROS messaging.
+///
+///   velodyne_puck_bench [capture.pcap] [num_packets]
+
+#include "decoder.h"
+#include "pcap.h"
+
+#include <sensor_msgs/image_encodings.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+// Count every heap allocation of the process
+static std::atomic<size_t> g_num_allocs{0};
+
+void* operator new(size_t size) {
+  ++g_num_allocs;
+  if (void* ptr = std::malloc(size)) return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+namespace velodyne_puck {
+namespace {
+
+static constexpr size_t kPacketSize =
+    sizeof(velodyne_msgs::VelodynePacket().data);
+using RawPacket = std::array<uint8_t, kPacketSize>;
+
+// One revolution at 600 rpm
+static constexpr int kRpm = 600;
+static constexpr int kDefaultPackets = 100000;
+
+/// Strongest return VLP-16 packets at kRpm, about 10% no returns
+std::vector<RawPacket> SyntheticPackets(int num_packets) {
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> distance(0, 40000);
+  std::uniform_int_distribution<int> reflectivity(0, 255);
+
+  const auto raw_per_block =
+      2 * AzimuthResolutionDegree(kRpm) / kAzimuthResolution;
+  double raw_azimuth = 0;
+
+  std::vector<RawPacket> packets(num_packets);
+  for (auto& packet : packets) {
+    packet.fill(0);
+    for (int b = 0; b < kBlocksPerPacket; ++b) {
+      auto* block = packet.data() + b * 100;
+      const uint16_t azimuth = static_cast<int>(raw_azimuth) % kNumRawAzimuths;
+      raw_azimuth += raw_per_block;
+      memcpy(block, &UPPER_BANK, sizeof(UPPER_BANK));
+      memcpy(block + 2, &azimuth, sizeof(azimuth));
+      for (int p = 0; p < kPointsPerBlock; ++p) {
+        auto d = distance(rng);
+        if (d < 4000) d = 0;
+        const uint16_t raw_distance = d;
+        memcpy(block + 4 + p * kPointBytes, &raw_distance, 2);
+        block[4 + p * kPointBytes + 2] = reflectivity(rng);
+      }
+    }
+    packet[kPacketSize - 2] = 55;  // strongest return
+    packet[kPacketSize - 1] = 34;  // VLP-16
+  }
+  return packets;
+}
+
+/// Every data packet in a capture
+std::vector<RawPacket> PcapPackets(const std::string& path) {
+  std::vector<RawPacket> packets;
+  PcapReader reader(path);
+  PcapReader::Datagram datagram;
+  while (reader.Next(datagram)) {
+    if (datagram.size != kPacketSize) continue;
+    packets.emplace_back();
+    memcpy(packets.back().data(), datagram.payload, kPacketSize);
+  }
+  return packets;
+}
+
+/// Output modes, matching what the decoder publishes
+enum class Mode { kOrganized, kDense, kImage, kSplit, kDeskew, kPacked };
+
+const char* ModeName(Mode mode) {
+  switch (mode) {
+    case Mode::kOrganized:
+      return "organized";
+    case Mode::kDense:
+      return "dense";
+    case Mode::kImage:
+      return "image";
+    case Mode::kSplit:
+      return "split";
+    case Mode::kDeskew:
+      return "deskew";
+    case Mode::kPacked:
+      return "packed";
+  }
+  return "";
+}
+
+/// Reused output messages, as the pools do in steady state
+struct Outputs {
+  sensor_msgs::PointCloud2 cloud;
+  sensor_msgs::Image image, range, intensity, packed;
+  ColumnTransforms transforms;
+};
+
+void Convert(Mode mode, const ScanBuffer& scan, const BeamTable& beams,
+             Outputs& out) {
+  const auto view = [&scan](const std::vector<float>& plane) {
+    return cv::Mat(scan.rows, scan.cols, CV_32FC1,
+                   const_cast<float*>(plane.data()),
+                   scan.stride * sizeof(float));
+  };
+  std_msgs::Header header;
+
+  switch (mode) {
+    case Mode::kOrganized:
+    case Mode::kDense: {
+      CloudOptions options;
+      options.organized = mode == Mode::kOrganized;
+      ToCloud(scan, beams, options, out.cloud);
+      break;
+    }
+    case Mode::kDeskew: {
+      // Organized cloud of a sensor moving at 1 m/s and turning 30 deg/s
+      Pose start, end;
+      const auto duration =
+          (scan.timestamps[scan.cols - 1] - scan.timestamps[0]) * 1e-9;
+      const auto yaw = deg2rad(30) * duration;
+      end.qw = std::cos(yaw / 2);
+      end.qz = std::sin(yaw / 2);
+      end.x = duration;
+      InterpolateColumns(start, end, scan.timestamps.data(), 0, scan.cols,
+                         out.transforms);
+
+      CloudOptions options;
+      options.deskew = &out.transforms;
+      ToCloud(scan, beams, options, out.cloud);
+      break;
+    }
+    case Mode::kImage: {
+      const cv::Mat planes[3] = {view(scan.range), view(scan.intensity),
+                                 view(scan.azimuth)};
+      cv::Mat image =
+          ResizeImage(header, sensor_msgs::image_encodings::TYPE_32FC3,
+                      scan.rows, scan.cols, CV_32FC3, out.image);
+      cv::merge(planes, 3, image);
+      break;
+    }
+    case Mode::kSplit: {
+      cv::Mat range = ResizeImage(header, sensor_msgs::image_encodings::MONO8,
+                                  scan.rows, scan.cols, CV_8UC1, out.range);
+      view(scan.range).convertTo(range, CV_8UC1, 3.0);
+      cv::Mat intensity =
+          ResizeImage(header, sensor_msgs::image_encodings::MONO8, scan.rows,
+                      scan.cols, CV_8UC1, out.intensity);
+      view(scan.intensity).convertTo(intensity, CV_8UC1, 1.0);
+      break;
+    }
+    case Mode::kPacked:
+      ToPacked(scan, 0, scan.cols, header, out.packed);
+      break;
+  }
+}
+
+struct Result {
+  double seconds{0};
+  size_t packets{0};
+  size_t points{0};
+  size_t sweeps{0};
+  size_t allocs{0};
+};
+
+Result Run(Mode mode, const std::vector<RawPacket>& packets, int num_packets) {
+  const BeamTable beams;
+
+  // Full sweeps cut on azimuth, converted as soon as they are done
+  Result result;
+  bool measuring = false;
+  ScanBuffer scan;
+  Outputs outputs;
+  PacketDecoder decoder([&](ScanBuffer& sweep) {
+    Convert(mode, sweep, beams, outputs);
+    if (measuring) {
+      result.points += sweep.num_valid;
+      ++result.sweeps;
+    }
+    return &sweep;
+  });
+  decoder.Reset(&scan, DecodeOptions());
+
+  const auto decode = [&](int i) {
+    decoder.Decode(packets[i % packets.size()].data(), kPacketSize,
+                   i * 1327000ull);
+  };
+
+  // Warm up for a few sweeps so buffers have their final size
+  const int num_warmup =
+      3 * (SweepColumns(kRpm) + kSequencesPerPacket - 1) / kSequencesPerPacket;
+  for (int i = 0; i < num_warmup; ++i) decode(i);
+
+  measuring = true;
+  const auto allocs_start = g_num_allocs.load();
+  const auto start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < num_packets; ++i) decode(num_warmup + i);
+
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  result.allocs = g_num_allocs.load() - allocs_start;
+  result.packets = num_packets;
+  return result;
+}
+
+}  // namespace
+}  // namespace velodyne_puck
+
+int main(int argc, char** argv) {
+  using namespace velodyne_puck;
+
+  const std::string pcap = argc > 1 ? argv[1] : "";
+  const int num_packets = argc > 2 ? std::atoi(argv[2]) : kDefaultPackets;
+
+  const auto packets =
+      pcap.empty() ? SyntheticPackets(kDefaultPackets) : PcapPackets(pcap);
+  if (packets.empty() || num_packets <= 0) {
+    std::fprintf(stderr, "No packets to decode\n");
+    return EXIT_FAILURE;
+  }
+
+  std::printf("source: %s, %zu distinct packets, %d decoded, kernel: %s\n",
+              pcap.empty() ? "synthetic" : pcap.c_str(), packets.size(),
+              num_packets, GetDecodeSequenceName());
+  std::printf("%-10s %12s %12s %10s %13s\n", "mode", "packets/s", "points/s",
+              "ns/packet", "allocs/sweep");
+
+  for (const auto mode : {Mode::kOrganized, Mode::kDense, Mode::kImage,
+                          Mode::kSplit, Mode::kDeskew, Mode::kPacked}) {
+    const auto r = Run(mode, packets, num_packets);
+    std::printf("%-10s %12.0f %12.0f %10.1f %13.2f\n", ModeName(mode),
+                r.packets / r.seconds, r.points / r.seconds,
+                r.seconds * 1e9 / r.packets,
+                r.sweeps > 0 ? static_cast<double>(r.allocs) / r.sweeps : 0.0);
+  }
+}
@@ -0,0 +1,41 @@
+#include "calibration.h"
+
+#include <cmath>
+
+namespace velodyne_puck {
+
+/// Geometry of row r for laser correction
+inline void SetBeam(int r, const LaserCorrection& laser, BeamTable& beams) {
+  const auto phi = laser.vert_correction;
+  beams.elevations[r] = phi;
+  beams.cos_elevation[r] = std::cos(phi);
+  beams.sin_elevation[r] = std::sin(phi);
+
+  // Positive, so that azimuths stay positive for the raw azimuth table
+  auto offset = std::fmod(-laser.rot_correction, static_cast<double>(kTau));
+  if (offset < 0) offset += kTau;
+  beams.azimuth_offset[r] = offset;
+
+  beams.distance_bias[r] = laser.dist_correction;
+  beams.xy_offset[r] = -laser.vert_offset_correction * std::sin(phi);
+  beams.z_offset[r] = laser.vert_offset_correction * std::cos(phi);
+  beams.horiz_offset[r] = laser.horiz_offset_correction;
+}
+
+BeamTable::BeamTable(Model model) : elevations(kFiringsPerSequence) {
+  for (int r = 0; r < kFiringsPerSequence; ++r) {
+    LaserCorrection laser;
+    laser.vert_correction = NominalElevation(model, r);
+    SetBeam(r, laser, *this);
+  }
+}
+
+BeamTable::BeamTable(const std::vector<LaserCorrection>& lasers)
+    : BeamTable() {
+  for (const auto& laser : lasers) {
+    if (laser.laser_id < 0 || laser.laser_id >= kFiringsPerSequence) continue;
+    SetBeam(LaserId2Row(laser.laser_id), laser, *this);
+  }
+}
+
+}  // namespace velodyne_puck
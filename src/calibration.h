@@ -0,0 +1,75 @@
+#pragma once
+
+#include "constants.h"
+#include "model.h"
+
+#include <vector>
+
+namespace velodyne_puck {
+
+/// Factory correction of one laser as in the calibration files of the sensor
+/// (velodyne_pointcloud format), angles in rad and lengths in m
+struct LaserCorrection {
+  int laser_id{0};
+  double vert_correction{0};          // elevation
+  double rot_correction{0};           // subtracted from the azimuth
+  double dist_correction{0};          // added to the range
+  double vert_offset_correction{0};   // of the beam origin along z
+  double horiz_offset_correction{0};  // of the beam origin, normal to the beam
+};
+
+/// Geometry of one beam, see BeamTable
+struct Beam {
+  float cos_elevation;
+  float sin_elevation;
+  float azimuth_offset;  // [rad] in [0, 2pi)
+  float distance_bias;   // [m]
+  float xy_offset;       // [m]
+  float z_offset;        // [m]
+  float horiz_offset;    // [m]
+
+  /// Point (x, y, z) of range [m], cos_theta and sin_theta are those of the
+  /// azimuth including azimuth_offset
+  void Point(float range, float cos_theta, float sin_theta, float& x,
+             float& y, float& z) const {
+    const auto d = range + distance_bias;
+    const auto xy = d * cos_elevation + xy_offset;
+    x = xy * cos_theta + horiz_offset * sin_theta;
+    y = -xy * sin_theta + horiz_offset * cos_theta;
+    z = d * sin_elevation + z_offset;
+  }
+};
+
+/// Geometry of each beam in image row order, baked once so that converting a
+/// point only looks up constants of its row. Point of range d at azimuth
+/// theta + azimuth_offset is
+///   xy = (d + distance_bias) * cos_elevation + xy_offset
+///   x = xy * cos(theta) + horiz_offset * sin(theta)
+///   y = -xy * sin(theta) + horiz_offset * cos(theta)
+///   z = (d + distance_bias) * sin_elevation + z_offset
+struct BeamTable {
+  /// Nominal uniform elevation grid of model, no offsets
+  explicit BeamTable(Model model = Model::kVlp16);
+  /// From one correction per laser id in [0, kFiringsPerSequence), laser ids
+  /// missing from lasers keep their nominal geometry
+  explicit BeamTable(const std::vector<LaserCorrection>& lasers);
+
+  /// Constants of image row r, copied out of the table so that a loop over
+  /// a row keeps them in registers
+  Beam Row(int r) const {
+    return {cos_elevation[r], sin_elevation[r], azimuth_offset[r],
+            distance_bias[r], xy_offset[r], z_offset[r], horiz_offset[r]};
+  }
+
+  alignas(16) float cos_elevation[kFiringsPerSequence];
+  alignas(16) float sin_elevation[kFiringsPerSequence];
+  alignas(16) float azimuth_offset[kFiringsPerSequence];  // [rad] in [0, 2pi)
+  alignas(16) float distance_bias[kFiringsPerSequence];   // [m]
+  alignas(16) float xy_offset[kFiringsPerSequence];       // [m]
+  alignas(16) float z_offset[kFiringsPerSequence];        // [m]
+  alignas(16) float horiz_offset[kFiringsPerSequence];    // [m]
+
+  std::vector<double> elevations;  // [rad] of each row, for the camera info
+};
+
+}  // namespace velodyne_puck
@@ -39,6 +39,11 @@ static constexpr int kBlocksPerPacket = 12;
 static constexpr int kSequencesPerPacket =
     kSequencesPerBlock * kBlocksPerPacket;  // 25
 
+// p49 8.2.1
+static constexpr double kDelayPerPacketNs =
+    kSequencesPerPacket * kFiringCycleNs;
+static constexpr double kPacketsPerSecond = 1e9 / kDelayPerPacketNs;
+
 inline int LaserId2Row(int id) {
   const auto index = (id % 2 == 0) ? id / 2 : id / 2 + kFiringsPerSequence / 2;
   return kFiringsPerSequence - index - 1;
@@ -57,6 +62,15 @@ inline constexpr float Raw2Azimuth(uint16_t raw) {
   return deg2rad(static_cast<float>(raw) * kAzimuthResolution);
 }
 
+static constexpr int kNumRawAzimuths = kMaxRawAzimuth + 1;  // 36000
+
+/// Nearest raw azimuth of azimuth [rad], wrapped into [0, 35999]
+inline int Azimuth2Raw(float azimuth) {
+  const auto raw =
+      static_cast<int>(rad2deg(azimuth) / kAzimuthResolution + 0.5f);
+  return raw % kNumRawAzimuths;
+}
+
 /// p55 9.3.1.2
 inline constexpr float Raw2Distance(uint16_t raw) {
   return static_cast<float>(raw) * kDistanceResolution;
@@ -68,4 +82,22 @@ inline constexpr float AzimuthResolutionDegree(int rpm) {
   return rpm / 60.0 * 360.0 * kFiringCycleNs / 1e9;
 }
 
+/// Supported motor speeds, p30 6.1
+static constexpr int kMinRpm = 300;
+static constexpr int kMaxRpm = 1200;
+
+/// Number of firing sequences in one revolution
+inline int SweepColumns(int rpm) {
+  return static_cast<int>(std::ceil(360.0 / AzimuthResolutionDegree(rpm)));
+}
+
+/// Rpm from the raw azimuths of two data blocks nblocks apart, consecutive
+/// blocks are two firing cycles apart
+inline int EstimateRpm(uint16_t raw_first, uint16_t raw_last, int nblocks) {
+  const auto delta = (raw_last + kNumRawAzimuths - raw_first) % kNumRawAzimuths;
+  const auto degree_per_sec = delta * kAzimuthResolution /
+                              (nblocks * 2 * kFiringCycleNs * 1e-9);
+  return static_cast<int>(std::round(degree_per_sec / 360.0 * 60.0));
+}
+
 }  // namespace velodyne_puck
@@ -0,0 +1,175 @@
+#include "decode_kernel.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VELODYNE_PUCK_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VELODYNE_PUCK_NEON 1
+#endif
+
+namespace velodyne_puck {
+
+/// Per row constants shared by the vector kernels
+struct KernelTables {
+  KernelTables() {
+    for (int r = 0; r < kFiringsPerSequence; ++r) {
+      const auto lid = kRow2LaserId[r];
+      offsets[r] = lid * kPointBytes;
+      lids[r] = lid;
+      lids_u8[r] = lid;
+    }
+  }
+
+  alignas(32) int32_t offsets[kFiringsPerSequence];  // byte offset of point
+  alignas(32) float lids[kFiringsPerSequence];        // firing order
+  alignas(16) uint8_t lids_u8[kFiringsPerSequence];
+};
+
+static const KernelTables kTables;
+
+RangeLimits::RangeLimits(float min_range, float max_range,
+                         const float* distance_bias) {
+  for (int r = 0; r < kFiringsPerSequence; ++r) {
+    const auto bias = distance_bias ? distance_bias[r] : 0.0f;
+    // Distances are multiples of the resolution, so this excludes zero
+    min[r] = std::max(min_range - bias, kDistanceResolution);
+    max[r] = max_range - bias;
+  }
+}
+
+int DecodeSequenceScalar(const uint8_t* points, float azimuth,
+                         float firing_gap, const RangeLimits& limits,
+                         DecodedSequence& out) {
+  int num_valid = 0;
+  for (int r = 0; r < kFiringsPerSequence; ++r) {
+    const auto* point = points + kTables.offsets[r];
+    // Little-endian distance followed by reflectivity
+    const uint16_t distance = point[0] | (point[1] << 8);
+    const float range = distance * kDistanceResolution;
+    const bool valid = range >= limits.min[r] && range <= limits.max[r];
+    out.range[r] = valid ? range : kNaNF;
+    out.intensity[r] = point[2];
+    out.azimuth[r] = azimuth + kTables.lids[r] * firing_gap;
+    num_valid += valid;
+  }
+  return num_valid;
+}
+
+#if defined(VELODYNE_PUCK_X86)
+/// Gather the 3-byte points of 8 rows as 4-byte words, then mask out distance
+/// and reflectivity. Reading one byte past the last point is fine inside a
+/// packet.
+__attribute__((target("avx2,popcnt"))) int DecodeSequenceAvx2(
+    const uint8_t* points, float azimuth, float firing_gap,
+    const RangeLimits& limits, DecodedSequence& out) {
+  const auto* base = reinterpret_cast<const int*>(points);
+  const __m256i mask_distance = _mm256_set1_epi32(0xffff);
+  const __m256i mask_reflectivity = _mm256_set1_epi32(0xff);
+  const __m256 resolution = _mm256_set1_ps(kDistanceResolution);
+  const __m256 azimuth_v = _mm256_set1_ps(azimuth);
+  const __m256 gap_v = _mm256_set1_ps(firing_gap);
+  const __m256 nan_v = _mm256_set1_ps(kNaNF);
+
+  int num_valid = 0;
+  for (int r = 0; r < kFiringsPerSequence; r += 8) {
+    const __m256i offsets = _mm256_load_si256(
+        reinterpret_cast<const __m256i*>(kTables.offsets + r));
+    const __m256i words = _mm256_i32gather_epi32(base, offsets, 1);
+
+    const __m256i distance = _mm256_and_si256(words, mask_distance);
+    const __m256i reflectivity =
+        _mm256_and_si256(_mm256_srli_epi32(words, 16), mask_reflectivity);
+
+    const __m256 range =
+        _mm256_mul_ps(_mm256_cvtepi32_ps(distance), resolution);
+    const __m256 valid = _mm256_and_ps(
+        _mm256_cmp_ps(range, _mm256_loadu_ps(limits.min + r), _CMP_GE_OQ),
+        _mm256_cmp_ps(range, _mm256_loadu_ps(limits.max + r), _CMP_LE_OQ));
+    _mm256_store_ps(out.range + r, _mm256_blendv_ps(nan_v, range, valid));
+    num_valid += _mm_popcnt_u32(_mm256_movemask_ps(valid));
+    _mm256_store_ps(out.intensity + r, _mm256_cvtepi32_ps(reflectivity));
+
+    const __m256 lids = _mm256_load_ps(kTables.lids + r);
+    _mm256_store_ps(out.azimuth + r,
+                    _mm256_add_ps(azimuth_v, _mm256_mul_ps(lids, gap_v)));
+  }
+  return num_valid;
+}
+#endif
+
+#if defined(VELODYNE_PUCK_NEON)
+/// Deinterleave distance low/high bytes and reflectivity with one vld3, then
+/// shuffle lasers into row order before widening
+int DecodeSequenceNeon(const uint8_t* points, float azimuth, float firing_gap,
+                       const RangeLimits& limits, DecodedSequence& out) {
+  const uint8x16x3_t bytes = vld3q_u8(points);
+  const uint8x16_t rows = vld1q_u8(kTables.lids_u8);
+  const uint8x16_t lo = vqtbl1q_u8(bytes.val[0], rows);
+  const uint8x16_t hi = vqtbl1q_u8(bytes.val[1], rows);
+  const uint8x16_t reflectivity = vqtbl1q_u8(bytes.val[2], rows);
+
+  const uint16x8_t distance[2] = {
+      vorrq_u16(vmovl_u8(vget_low_u8(lo)),
+                vshlq_n_u16(vmovl_u8(vget_low_u8(hi)), 8)),
+      vorrq_u16(vmovl_u8(vget_high_u8(lo)),
+                vshlq_n_u16(vmovl_u8(vget_high_u8(hi)), 8))};
+  const uint16x8_t intensity[2] = {vmovl_u8(vget_low_u8(reflectivity)),
+                                   vmovl_u8(vget_high_u8(reflectivity))};
+
+  const float32x4_t azimuth_v = vdupq_n_f32(azimuth);
+  const float32x4_t nan_v = vdupq_n_f32(kNaNF);
+
+  uint32x4_t num_valid = vdupq_n_u32(0);
+  for (int h = 0; h < 2; ++h) {
+    const uint32x4_t d[2] = {vmovl_u16(vget_low_u16(distance[h])),
+                             vmovl_u16(vget_high_u16(distance[h]))};
+    const uint32x4_t i[2] = {vmovl_u16(vget_low_u16(intensity[h])),
+                             vmovl_u16(vget_high_u16(intensity[h]))};
+    for (int q = 0; q < 2; ++q) {
+      const int r = h * 8 + q * 4;
+      const float32x4_t range =
+          vmulq_n_f32(vcvtq_f32_u32(d[q]), kDistanceResolution);
+      const uint32x4_t valid =
+          vandq_u32(vcgeq_f32(range, vld1q_f32(limits.min + r)),
+                    vcleq_f32(range, vld1q_f32(limits.max + r)));
+      vst1q_f32(out.range + r, vbslq_f32(valid, range, nan_v));
+      num_valid = vsubq_u32(num_valid, valid);  // valid lanes are all ones
+      vst1q_f32(out.intensity + r, vcvtq_f32_u32(i[q]));
+      const float32x4_t lids = vld1q_f32(kTables.lids + r);
+      vst1q_f32(out.azimuth + r,
+                vaddq_f32(azimuth_v, vmulq_n_f32(lids, firing_gap)));
+    }
+  }
+  return vaddvq_u32(num_valid);
+}
+#endif
+
+struct DecodeSequenceImpl {
+  DecodeSequenceFn fn;
+  const char* name;
+};
+
+static DecodeSequenceImpl SelectDecodeSequence() {
+#if defined(VELODYNE_PUCK_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return {DecodeSequenceAvx2, "avx2"};
+#elif defined(VELODYNE_PUCK_NEON)
+  // NEON is mandatory on aarch64
+  return {DecodeSequenceNeon, "neon"};
+#endif
+  return {DecodeSequenceScalar, "scalar"};
+}
+
+static const DecodeSequenceImpl& GetDecodeSequenceImpl() {
+  static const DecodeSequenceImpl impl = SelectDecodeSequence();
+  return impl;
+}
+
+DecodeSequenceFn GetDecodeSequence() { return GetDecodeSequenceImpl().fn; }
+
+const char* GetDecodeSequenceName() { return GetDecodeSequenceImpl().name; }
+
+}  // namespace velodyne_puck
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "constants.h"
+
+namespace velodyne_puck {
+
+/// Image row of each laser, inverse of LaserId2Row()
+static constexpr int kRow2LaserId[kFiringsPerSequence] = {
+    15, 13, 11, 9, 7, 5, 3, 1, 14, 12, 10, 8, 6, 4, 2, 0};
+
+/// One firing sequence unpacked into image row order, row 0 is the top laser
+struct DecodedSequence {
+  float range[kFiringsPerSequence];      // [m]
+  float intensity[kFiringsPerSequence];  // reflectivity
+  float azimuth[kFiringsPerSequence];    // [rad]
+} __attribute__((aligned(32)));
+
+/// Valid ranges [m] of the raw distance of each row, in image row order
+struct RangeLimits {
+  /// Limits of the range plus distance_bias of each row, see BeamTable. Zero
+  /// (no return) is never valid.
+  RangeLimits(float min_range = 0, float max_range = kDistanceMax,
+              const float* distance_bias = nullptr);
+
+  float min[kFiringsPerSequence];
+  float max[kFiringsPerSequence];
+};
+
+/// Unpack the 16 packed 3-byte data points of a firing sequence, the azimuth
+/// of laser lid is azimuth + lid * firing_gap. Ranges outside the limits of
+/// their row are set to NaN. Returns the number of valid ranges. points must
+/// be followed by at least one readable byte, which holds for every sequence
+/// inside a packet.
+using DecodeSequenceFn = int (*)(const uint8_t* points, float azimuth,
+                                 float firing_gap, const RangeLimits& limits,
+                                 DecodedSequence& out);
+
+/// Portable reference implementation
+int DecodeSequenceScalar(const uint8_t* points, float azimuth,
+                         float firing_gap, const RangeLimits& limits,
+                         DecodedSequence& out);
+
+/// Fastest implementation supported by this cpu, selected once at runtime
+DecodeSequenceFn GetDecodeSequence();
+
+/// Name of the implementation returned by GetDecodeSequence()
+const char* GetDecodeSequenceName();
+
+}  // namespace velodyne_puck
@@ -1,331 +1,901 @@
-#include "constants.h"
+#include "decoder.h"
 
 #include <cv_bridge/cv_bridge.h>
-#include <dynamic_reconfigure/server.h>
-#include <image_transport/camera_publisher.h>
-#include <image_transport/image_transport.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl_ros/point_cloud.h>
 
-#include <sensor_msgs/CameraInfo.h>
-#include <sensor_msgs/Image.h>
 #include <sensor_msgs/PointCloud2.h>
-#include <velodyne_msgs/VelodynePacket.h>
-#include <velodyne_msgs/VelodyneScan.h>
-#include <velodyne_puck/VelodynePuckConfig.h>
+#include <sensor_msgs/PointField.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <limits>
 
 namespace velodyne_puck {
 
 using namespace sensor_msgs;
 using namespace velodyne_msgs;
+using namespace diagnostic_updater;
+
+// Packets older than this when decoded mean decoding falls behind, more than
+// one revolution at the slowest rpm so scans of whole revolutions are fine
+static const ros::Duration kLatePacketAge(0.25);
+
+/// sin and cos of every raw azimuth, 0.01 degree apart
+struct AzimuthTable {
+  AzimuthTable() : cos(kNumRawAzimuths), sin(kNumRawAzimuths) {
+    for (int i = 0; i < kNumRawAzimuths; ++i) {
+      const auto azimuth = Raw2Azimuth(i);
+      cos[i] = std::cos(azimuth);
+      sin[i] = std::sin(azimuth);
+    }
+  }
 
-using PointT = pcl::PointXYZI;
-using CloudT = pcl::PointCloud<PointT>;
-
-/// Convert image and camera_info to point cloud
-CloudT ToCloud(const ImageConstPtr& image_msg, const CameraInfo& cinfo_msg,
-               bool organized);
-
-/// Used for indexing into packet and image, (NOISE not used now)
-enum Index { RANGE = 0, INTENSITY = 1, AZIMUTH = 2, NOISE = 3 };
-
-class Decoder {
- public:
-  /// Number of channels for image data
-  static constexpr int kChannels = 2;  // (range [m], intensity)
-
-  explicit Decoder(const ros::NodeHandle& pnh);
-
-  Decoder(const Decoder&) = delete;
-  Decoder operator=(const Decoder&) = delete;
-
-  void PacketCb(const VelodynePacketConstPtr& packet_msg);
-  void ConfigCb(VelodynePuckConfig& config, int level);
-
- private:
-  /// All of these uses laser index from velodyne which is interleaved
-
-  /// 9.3.1.3 Data Point
-  /// A data point is a measurement by one laser channel of a relection of a
-  /// laser pulse
-  struct DataPoint {
-    uint16_t distance;
-    uint8_t reflectivity;
-  } __attribute__((packed));
-  static_assert(sizeof(DataPoint) == 3, "sizeof(DataPoint) != 3");
-
-  /// 9.3.1.1 Firing Sequence
-  /// A firing sequence occurs when all the lasers in a sensor are fired. There
-  /// are 16 firings per cycle for VLP-16
-  struct FiringSequence {
-    DataPoint points[kFiringsPerSequence];  // 16
-  } __attribute__((packed));
-  static_assert(sizeof(FiringSequence) == 48, "sizeof(FiringSequence) != 48");
-
-  /// 9.3.1.4 Azimuth
-  /// A two-byte azimuth value (alpha) appears after the flag bytes at the
-  /// beginning of each data block
-  ///
-  /// 9.3.1.5 Data Block
-  /// The information from 2 firing sequences of 16 lasers is contained in each
-  /// data block. Each packet contains the data from 24 firing sequences in 12
-  /// data blocks.
-  struct DataBlock {
-    uint16_t flag;
-    uint16_t azimuth;                              // [0, 35999]
-    FiringSequence sequences[kSequencesPerBlock];  // 2
-  } __attribute__((packed));
-  static_assert(sizeof(DataBlock) == 100, "sizeof(DataBlock) != 100");
-
-  struct Packet {
-    DataBlock blocks[kBlocksPerPacket];  // 12
-    /// The four-byte time stamp is a 32-bit unsigned integer marking the moment
-    /// of the first data point in the first firing sequcne of the first data
-    /// block. The time stamp’s value is the number of microseconds elapsed
-    /// since the top of the hour.
-    uint32_t stamp;
-    uint8_t factory[2];
-  } __attribute__((packed));
-  static_assert(sizeof(Packet) == sizeof(velodyne_msgs::VelodynePacket().data),
-                "sizeof(Packet) != 1206");
-
-  void DecodeAndFill(const Packet* const packet_buf, uint64_t time);
-
- private:
-  bool CheckFactoryBytes(const Packet* const packet);
-  void Reset();
-
-  // ROS related parameters
-  std::string frame_id_;
-  ros::NodeHandle pnh_;
-  image_transport::ImageTransport it_;
-  ros::Subscriber packet_sub_;
-  ros::Publisher cloud_pub_;
-  image_transport::Publisher intensity_pub_, range_pub_;
-  image_transport::CameraPublisher camera_pub_;
-  dynamic_reconfigure::Server<VelodynePuckConfig> cfg_server_;
-  VelodynePuckConfig config_;
-
-  // cached
-  cv::Mat image_;
-  std::vector<double> azimuths_;
-  std::vector<uint64_t> timestamps_;
-  int curr_col_{0};
-  std::vector<double> elevations_;
+  std::vector<float> cos, sin;
 };
 
-Decoder::Decoder(const ros::NodeHandle& pnh)
-    : pnh_(pnh), it_(pnh), cfg_server_(pnh) {
+const AzimuthTable& GetAzimuthTable() {
+  static const AzimuthTable table;
+  return table;
+}
+
+/// Number of an XmlRpc value, yaml numbers without a fraction are ints
+bool GetNumber(XmlRpc::XmlRpcValue& value, double& number) {
+  if (value.getType() == XmlRpc::XmlRpcValue::TypeDouble) {
+    number = static_cast<double>(value);
+  } else if (value.getType() == XmlRpc::XmlRpcValue::TypeInt) {
+    number = static_cast<int>(value);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool LoadCalibration(const ros::NodeHandle& nh, BeamTable& beams) {
+  XmlRpc::XmlRpcValue lasers;
+  if (!nh.getParam("calibration/lasers", lasers)) {
+    ROS_INFO("No calibration, using nominal elevations");
+    return false;
+  }
+  if (lasers.getType() != XmlRpc::XmlRpcValue::TypeArray ||
+      lasers.size() != kFiringsPerSequence) {
+    ROS_ERROR("calibration/lasers is not a list of %d lasers, using nominal "
+              "elevations",
+              kFiringsPerSequence);
+    return false;
+  }
+
+  // Only vert_correction is required, missing offsets are 0
+  std::vector<LaserCorrection> corrections(kFiringsPerSequence);
+  std::vector<bool> seen(kFiringsPerSequence, false);
+  for (int i = 0; i < lasers.size(); ++i) {
+    auto& laser = lasers[i];
+    double laser_id = -1;
+    if (laser.getType() == XmlRpc::XmlRpcValue::TypeStruct &&
+        laser.hasMember("laser_id")) {
+      GetNumber(laser["laser_id"], laser_id);
+    }
+    const int id = static_cast<int>(laser_id);
+    if (laser_id < 0 || id >= kFiringsPerSequence || seen[id] ||
+        !laser.hasMember("vert_correction")) {
+      ROS_ERROR("Laser %d of calibration has no valid laser_id or no "
+                "vert_correction, using nominal elevations",
+                i);
+      return false;
+    }
+    seen[id] = true;
+
+    auto& correction = corrections[i];
+    correction.laser_id = id;
+    const std::pair<const char*, double*> fields[] = {
+        {"vert_correction", &correction.vert_correction},
+        {"rot_correction", &correction.rot_correction},
+        {"dist_correction", &correction.dist_correction},
+        {"vert_offset_correction", &correction.vert_offset_correction},
+        {"horiz_offset_correction", &correction.horiz_offset_correction}};
+    for (const auto& field : fields) {
+      if (laser.hasMember(field.first) &&
+          !GetNumber(laser[field.first], *field.second)) {
+        ROS_ERROR("%s of laser %d is not a number, using nominal elevations",
+                  field.first, correction.laser_id);
+        return false;
+      }
+    }
+  }
+
+  ROS_INFO("Loaded calibration of %d lasers", kFiringsPerSequence);
+  beams = BeamTable(corrections);
+  return true;
+}
+
+cv::Mat ResizeImage(const std_msgs::Header& header, const std::string& encoding,
+                    int rows, int cols, int type, Image& image) {
+  const auto elem_size = CV_ELEM_SIZE(type);
+  image.header = header;
+  image.height = rows;
+  image.width = cols;
+  image.encoding = encoding;
+  image.is_bigendian = false;
+  image.step = cols * elem_size;
+  image.data.resize(image.step * rows);
+  return cv::Mat(rows, cols, type, image.data.data(), image.step);
+}
+
+constexpr int Decoder::kNumProducts;
+
+/// Copy of nh whose subscriptions and services are served from queue
+ros::NodeHandle WithQueue(const ros::NodeHandle& nh,
+                          ros::CallbackQueue* queue) {
+  ros::NodeHandle copy(nh);
+  copy.setCallbackQueue(queue);
+  return copy;
+}
+
+Decoder::Decoder(const ros::NodeHandle& pnh, const std::string& name)
+    : spinner_(1, &queue_),
+      pnh_(WithQueue(pnh, &queue_)),
+      it_(pnh_),
+      cfg_server_(pnh_),
+      updater_(ros::NodeHandle(), pnh_),
+      decoder_([this](ScanBuffer& scan) { return FinishSweep(scan); },
+               [this](const ScanBuffer& scan, int col_begin, int col_end) {
+                 PublishSector(scan, col_begin, col_end);
+               }) {
   pnh_.param<std::string>("frame_id", frame_id_, "velodyne");
   ROS_INFO("Velodyne frame_id: %s", frame_id_.c_str());
+
+  // A calibration is that of the sensor, whatever model it reports
+  if (LoadCalibration(pnh_, beams_)) {
+    hi_res_beams_ = beams_;
+  } else {
+    hi_res_beams_ = BeamTable(Model::kPuckHiRes);
+  }
+
+  // Build azimuth table up front instead of in the first ToCloud
+  GetAzimuthTable();
+
+  ROS_INFO("Decode kernel: %s", decoder_.kernel_name());
+
+  // Deskew needs the pose of frame_id in fixed_frame from tf
+  pnh_.param<std::string>("fixed_frame", fixed_frame_, "");
+  pnh_.param("tf_timeout", tf_timeout_, 0.05);
+  if (!fixed_frame_.empty()) {
+    ROS_INFO("Deskew in fixed_frame: %s, tf_timeout: %f", fixed_frame_.c_str(),
+             tf_timeout_);
+    tf_buffer_.reset(new tf2_ros::Buffer);
+    tf_listener_.reset(new tf2_ros::TransformListener(*tf_buffer_));
+  }
+
+  // Products of a sweep are published in parallel, more workers than
+  // products do not help
+  int num_threads;
+  pnh_.param("num_threads", num_threads, 2);
+  num_threads = std::max(std::min(num_threads, kNumProducts), 1);
+
+  // At least one to decode into while the others are published
+  int num_sweeps;
+  pnh_.param("num_sweeps", num_sweeps, 2);
+  num_sweeps = std::max(num_sweeps, 2);
+  ROS_INFO("Sweep buffers: %d, publish threads: %d", num_sweeps, num_threads);
+  // Sweeps are not movable
+  std::vector<Sweep>(num_sweeps).swap(sweeps_);
+  sweep_ = &sweeps_.front();
+
+  // Images of every sweep in flight are preallocated for the widest sweep,
+  // a revolution at the slowest rpm or the largest image_width, so they never
+  // grow on the publish path
+  const auto max_cols = std::max(SweepColumns(kMinRpm),
+                                 VelodynePuckConfig::__getMax__().image_width);
+  const auto reserve = [num_sweeps, max_cols](Pool<Image>& pool,
+                                              int pixel_size) {
+    Image prototype;
+    prototype.data.resize(static_cast<size_t>(kFiringsPerSequence) *
+                          max_cols * pixel_size);
+    pool.Reserve(num_sweeps + 1, prototype);
+  };
+  reserve(image_pool_, 3 * sizeof(float));
+  reserve(range_pool_, 1);
+  reserve(intensity_pool_, 1);
+  reserve(packed_pool_, 3);
+  for (int i = 0; i < num_threads; ++i) {
+    publish_threads_.emplace_back(&Decoder::PublishLoop, this);
+  }
+
   cfg_server_.setCallback(boost::bind(&Decoder::ConfigCb, this, _1, _2));
 
-  // Pre-compute elevations
-  for (int i = 0; i < kFiringsPerSequence; ++i) {
-    elevations_.push_back(kMaxElevation - i * kDeltaElevation);
+  // Diagnostics are aggregated on the decode thread once per period
+  const auto prefix = name.empty() ? std::string() : name + "/";
+  updater_.setHardwareID("VLP16");
+  updater_.add(prefix + "decoder", this, &Decoder::DecodeDiagnostic);
+  updater_.add(prefix + "decoder latency", this, &Decoder::LatencyDiagnostic);
+  prev_diag_time_ = ros::WallTime::now();
+  diag_timer_ = pnh_.createWallTimer(
+      ros::WallDuration(updater_.getPeriod()),
+      [this](const ros::WallTimerEvent&) { updater_.force_update(); });
+
+  // Decode on a thread of our own, so that decoders of several sensors run
+  // in parallel while each one sees its packets in order
+  spinner_.start();
+}
+
+Decoder::~Decoder() {
+  {
+    std::lock_guard<std::mutex> lock(sweeps_mutex_);
+    stop_ = true;
   }
+  // Wakes up a FinishSweep() waiting for a free sweep before the spinner
+  // waits for the callback to return
+  sweeps_cv_.notify_all();
+  spinner_.stop();
+  for (auto& thread : publish_threads_) thread.join();
 }
 
-bool Decoder::CheckFactoryBytes(const Packet* const packet_buf) {
-  // Check return mode and product id, for now just die
-  const auto return_mode = packet_buf->factory[0];
+void Decoder::PacketCb(const VelodynePacketConstPtr& packet_msg) {
+  DecodePacket(*packet_msg);
+}
 
-  if (!(return_mode == 55 || return_mode == 56)) {
-    ROS_ERROR(
-        "return mode must be Strongest (55) or Last Return (56), "
-        "instead got (%u)",
-        return_mode);
-    return false;
+void Decoder::ScanCb(const VelodyneScanConstPtr& scan_msg) {
+  for (const auto& packet : scan_msg->packets) {
+    DecodePacket(packet);
   }
+}
 
-  const auto product_id = packet_buf->factory[1];
-  if (product_id != 34) {
-    ROS_ERROR("product id must be VLP-16 or Puck Lite (34), instead got (%u)",
-              product_id);
-    return false;
+void Decoder::DecodePacket(const VelodynePacket& packet) {
+  // Age on arrival tells how far decoding is behind the driver
+  const auto age = ros::Time::now() - packet.stamp;
+  packet_age_.Record(age.toNSec());
+  ++counters_.packets;
+  counters_.late_packets += age > kLatePacketAge;
+  counters_.max_backlog =
+      std::max(counters_.max_backlog, age.toSec() * kPacketsPerSecond);
+  packet_stamp_ = packet.stamp;
+
+  const auto prev = decoder_.stats();
+  DecodeResult result;
+  {
+    // Includes handing over a finished sweep and publishing sectors
+    ScopedLatency latency(decode_latency_);
+    result = decoder_.Decode(&packet.data[0], packet.data.size(),
+                             packet.stamp.toNSec());
   }
 
-  return true;
+  // Unsupported packets, for now just die
+  switch (result) {
+    case DecodeResult::kOk:
+      break;
+    case DecodeResult::kInvalidSize:
+      ROS_ERROR("packet size must be 1206, instead got %zu",
+                packet.data.size());
+      ros::shutdown();
+      return;
+    case DecodeResult::kInvalidReturnMode:
+      ROS_ERROR(
+          "return mode must be Strongest (55), Last Return (56) or Dual "
+          "Return (57), instead got (%u)",
+          packet.data[sizeof(Packet) - 2]);
+      ros::shutdown();
+      return;
+    case DecodeResult::kInvalidProductId:
+      ROS_ERROR(
+          "product id must be VLP-16 or Puck LITE (34) or Puck Hi-Res (36), "
+          "instead got (%u)",
+          packet.data[sizeof(Packet) - 1]);
+      ros::shutdown();
+      return;
+  }
+
+  const auto& stats = decoder_.stats();
+  ROS_WARN_COND(stats.invalid_azimuths != prev.invalid_azimuths,
+                "Invalid raw azimuth");
+  ROS_WARN_COND(stats.invalid_blocks != prev.invalid_blocks, "Invalid block");
+  if (stats.lost_packets != prev.lost_packets) {
+    ROS_WARN_THROTTLE(1, "Lost %zu packets, left NaN columns in their place",
+                      stats.lost_packets - prev.lost_packets);
+  }
+  if (stats.resyncs != prev.resyncs) {
+    ROS_WARN_THROTTLE(1, "Sweep longer than one revolution at %d rpm, resync",
+                      decoder_.rpm());
+  }
 }
 
-void Decoder::DecodeAndFill(const Packet* const packet_buf, uint64_t time) {
-  if (!CheckFactoryBytes(packet_buf)) {
-    ros::shutdown();
-  }
-
-  // transform
-  //            ^ x_l
-  //            | -> /
-  //            | a /
-  //            |  /
-  //            | /
-  // <----------o
-  // y_l
-
-  // For each data block, 12 total
-  for (int iblk = 0; iblk < kBlocksPerPacket; ++iblk) {
-    const auto& block = packet_buf->blocks[iblk];
-    const auto raw_azimuth = block.azimuth;         // nominal azimuth [0,35999]
-    const auto azimuth = Raw2Azimuth(raw_azimuth);  // nominal azimuth [0, 2pi)
-
-    ROS_WARN_STREAM_COND(raw_azimuth > kMaxRawAzimuth,
-                         "Invalid raw azimuth: " << raw_azimuth);
-    ROS_WARN_COND(block.flag != UPPER_BANK, "Invalid block %d", iblk);
-
-    float azimuth_gap{0};
-    if (iblk == kBlocksPerPacket - 1) {
-      // Last block, 12th
-      const auto& prev_block = packet_buf->blocks[iblk - 1];
-      const auto prev_azimuth = Raw2Azimuth(prev_block.azimuth);
-      azimuth_gap = azimuth - prev_azimuth;
-    } else {
-      // First 11 blocks
-      const auto& next_block = packet_buf->blocks[iblk + 1];
-      const auto next_azimuth = Raw2Azimuth(next_block.azimuth);
-      azimuth_gap = next_azimuth - azimuth;
+ScanBuffer* Decoder::FinishSweep(ScanBuffer& /*scan*/) {
+  // The decoder always fills sweep_->scan
+  sweep_->config = config_;
+  sweep_->received = packet_stamp_;
+
+  {
+    std::unique_lock<std::mutex> lock(sweeps_mutex_);
+    ++num_written_;
+    sweeps_cv_.notify_all();
+
+    counters_.max_sweeps =
+        std::max(counters_.max_sweeps, num_written_ - num_published_);
+    if (num_written_ - num_published_ >= sweeps_.size()) {
+      ++counters_.stalls;
+      ROS_WARN_THROTTLE(1, "Publishing falls behind, waiting for a free sweep");
+      sweeps_cv_.wait(lock, [this] {
+        return stop_ || num_written_ - num_published_ < sweeps_.size();
+      });
     }
+  }
+
+  sweep_ = &sweeps_[num_written_ % sweeps_.size()];
+  return &sweep_->scan;
+}
 
-    // Adjust for azimuth rollover from 2pi to 0
-    if (azimuth_gap < 0) azimuth_gap += kTau;
-    const auto half_azimuth_gap = azimuth_gap / 2;
-
-    // for each firing sequence in the data block, 2
-    for (int iseq = 0; iseq < kSequencesPerBlock; ++iseq, ++curr_col_) {
-      const auto col = iblk * 2 + iseq;
-      timestamps_[curr_col_] = time + col * kFiringCycleNs;
-      azimuths_[curr_col_] = azimuth + half_azimuth_gap * iseq;
-
-      const auto& seq = block.sequences[iseq];
-      // for each laser beam, 16
-      for (int lid = 0; lid < kFiringsPerSequence; ++lid) {
-        const auto& point = seq.points[lid];
-        auto& v = image_.at<cv::Vec3f>(LaserId2Row(lid), curr_col_);
-        v[RANGE] = point.distance * kDistanceResolution;
-        v[INTENSITY] = point.reflectivity;
-        const auto offset = lid * kSingleFiringRatio * half_azimuth_gap +
-                            iseq * half_azimuth_gap;
-        v[AZIMUTH] = azimuth + offset;
+void Decoder::PublishLoop() {
+  while (true) {
+    size_t task;
+    {
+      std::unique_lock<std::mutex> lock(sweeps_mutex_);
+      sweeps_cv_.wait(lock, [this] {
+        return stop_ || next_task_ < num_written_ * kNumProducts;
+      });
+      if (stop_) return;
+      task = next_task_++;
+    }
+
+    auto& sweep = sweeps_[(task / kNumProducts) % sweeps_.size()];
+    PublishSweep(sweep, static_cast<Product>(task % kNumProducts));
+
+    {
+      std::lock_guard<std::mutex> lock(sweeps_mutex_);
+      if (++sweep.num_done < kNumProducts) continue;
+
+      // Sweeps can complete out of order, only release them in order
+      ROS_DEBUG("Pool hits: %zu, misses: %zu", PoolHits(), PoolMisses());
+      sweep_latency_.Record((ros::Time::now() - sweep.received).toNSec());
+      while (num_published_ < num_written_) {
+        auto& oldest = sweeps_[num_published_ % sweeps_.size()];
+        if (oldest.num_done < kNumProducts) break;
+        oldest.num_done = 0;
+        oldest.ResetProducts();  // back to the pools
+        ++num_published_;
       }
     }
+    sweeps_cv_.notify_all();
   }
 }
 
-void Decoder::PacketCb(const VelodynePacketConstPtr& packet_msg) {
-  const auto start = ros::Time::now();
+void Decoder::PublishSweep(Sweep& sweep, Product product) {
+  const auto& scan = sweep.scan;
 
-  const auto* packet_buf =
-      reinterpret_cast<const Packet*>(&(packet_msg->data[0]));
-  DecodeAndFill(packet_buf, packet_msg->stamp.toNSec());
+  std_msgs::Header header;
+  header.frame_id = frame_id_;
+  header.stamp.fromNSec(scan.timestamps.front());
+
+  switch (product) {
+    case Product::kCamera:
+      if (camera_pub_.getNumSubscribers() > 0) {
+        PublishCamera(scan, 0, scan.cols, header,
+                      SweepCameraInfo(sweep, header), camera_pub_);
+      }
+      break;
 
-  if (curr_col_ < config_.image_width) {
-    return;
+    case Product::kCloud:
+      if (cloud_pub_.getNumSubscribers() > 0) {
+        cloud_pub_.publish(SweepCloud(sweep, header));
+      }
+      break;
+
+    case Product::kRange:
+      if (range_pub_.getNumSubscribers() > 0) {
+        range_pub_.publish(SweepRange(sweep, header));
+      }
+      break;
+
+    case Product::kIntensity:
+      if (intensity_pub_.getNumSubscribers() > 0) {
+        intensity_pub_.publish(SweepIntensity(sweep, header));
+      }
+      break;
+
+    case Product::kPacked:
+      PublishPacked(sweep, header);
+      break;
   }
+}
 
+void Decoder::PublishSector(const ScanBuffer& scan, int col_begin,
+                            int col_end) {
+  // Stamp is the time of the first column of the sector
   std_msgs::Header header;
   header.frame_id = frame_id_;
-  header.stamp.fromNSec(timestamps_.front());
+  header.stamp.fromNSec(scan.timestamps[col_begin]);
 
-  const ImagePtr image_msg =
-      cv_bridge::CvImage(header, "32FC3", image_).toImageMsg();
+  if (sector_camera_pub_.getNumSubscribers() > 0) {
+    PublishCamera(scan, col_begin, col_end, header,
+                  MakeCameraInfo(scan, col_begin, col_end, header),
+                  sector_camera_pub_);
+  }
+  // The sweep cloud reuses the trig of the sector clouds. This is the decode
+  // thread, which must not wait for tf.
+  if (sector_cloud_pub_.getNumSubscribers() > 0) {
+    sector_cloud_pub_.publish(MakeCloud(scan, col_begin, col_end, header,
+                                        config_, ros::Duration(0),
+                                        sector_deskew_, sweep_->trig, true));
+  }
+  sector_latency_.Record((ros::Time::now() - packet_stamp_).toNSec());
+}
+
+CameraInfoPtr Decoder::MakeCameraInfo(const ScanBuffer& scan, int col_begin,
+                                      int col_end,
+                                      const std_msgs::Header& header) {
+  const auto cols = col_end - col_begin;
 
   // Fill in camera info
-  const CameraInfoPtr cinfo_msg(new CameraInfo);
+  const CameraInfoPtr cinfo_msg = cinfo_pool_.Get();
   cinfo_msg->header = header;
-  cinfo_msg->height = image_msg->height;
-  cinfo_msg->width = image_msg->width;
+  cinfo_msg->height = scan.rows;
+  cinfo_msg->width = cols;
   cinfo_msg->distortion_model = "VLP16";
   cinfo_msg->P[0] = kFiringCycleNs;  // delta time between two measurements
 
+  // Columns of the sweep this image covers, the whole sweep has x_offset 0
+  cinfo_msg->roi.x_offset = col_begin;
+  cinfo_msg->roi.y_offset = 0;
+  cinfo_msg->roi.width = cols;
+  cinfo_msg->roi.height = scan.rows;
+
   // D = [altitude, azimuth]
-  cinfo_msg->D = elevations_;
-  cinfo_msg->D.insert(cinfo_msg->D.end(), azimuths_.begin(), azimuths_.end());
+  cinfo_msg->D = Beams(scan).elevations;
+  cinfo_msg->D.insert(cinfo_msg->D.end(), scan.azimuths.begin() + col_begin,
+                      scan.azimuths.begin() + col_end);
+  return cinfo_msg;
+}
 
-  // Publish on demand
-  if (camera_pub_.getNumSubscribers() > 0) {
-    camera_pub_.publish(image_msg, cinfo_msg);
+CameraInfoConstPtr Decoder::SweepCameraInfo(Sweep& sweep,
+                                            const std_msgs::Header& header) {
+  return sweep.cinfo.Get([&] {
+    return MakeCameraInfo(sweep.scan, 0, sweep.scan.cols, header);
+  });
+}
+
+/// Header only view into a plane of scan, no copy, read only
+inline cv::Mat PlaneView(const ScanBuffer& scan,
+                         const std::vector<float>& plane) {
+  return cv::Mat(scan.rows, scan.cols, CV_32FC1,
+                 const_cast<float*>(plane.data()),
+                 scan.stride * sizeof(float));
+}
+
+/// Smallest and largest value in the used columns of plane of scan, false if
+/// all are NaN. NaN of lost packets and unused columns are skipped, which
+/// cv::minMaxIdx does not reliably do.
+bool FiniteMinMax(const ScanBuffer& scan, const std::vector<float>& plane,
+                  float& min, float& max) {
+  min = std::numeric_limits<float>::infinity();
+  max = -min;
+  for (int r = 0; r < scan.rows; ++r) {
+    const auto* row = &plane[scan.Index(r, 0)];
+    for (int c = 0; c < scan.cols; ++c) {
+      // Both false for NaN
+      if (row[c] < min) min = row[c];
+      if (row[c] > max) max = row[c];
+    }
   }
+  return min <= max;
+}
+
+ImageConstPtr Decoder::SweepRange(Sweep& sweep,
+                                  const std_msgs::Header& header) {
+  return sweep.range.Get([&] {
+    ScopedLatency latency(image_latency_);
+    const auto& scan = sweep.scan;
+    const ImagePtr range_msg = range_pool_.Get();
+    cv::Mat range = ResizeImage(header, image_encodings::MONO8, scan.rows,
+                                scan.cols, CV_8UC1, *range_msg);
+    // should be 2, use 3 for more contrast
+    PlaneView(scan, scan.range).convertTo(range, CV_8UC1, 3.0);
+    return range_msg;
+  });
+}
+
+ImageConstPtr Decoder::SweepIntensity(Sweep& sweep,
+                                      const std_msgs::Header& header) {
+  return sweep.intensity.Get([&] {
+    ScopedLatency latency(image_latency_);
+    const auto& scan = sweep.scan;
+    const ImagePtr intensity_msg = intensity_pool_.Get();
+    cv::Mat intensity = ResizeImage(header, image_encodings::MONO8, scan.rows,
+                                    scan.cols, CV_8UC1, *intensity_msg);
+    // Stretched to the full 8 bits, all zero if there is nothing to stretch
+    float a, b;
+    if (FiniteMinMax(scan, scan.intensity, a, b) && b > a) {
+      PlaneView(scan, scan.intensity)
+          .convertTo(intensity, CV_8UC1, 255 / (b - a), 255 * a / (a - b));
+    } else {
+      intensity.setTo(0);
+    }
+    return intensity_msg;
+  });
+}
+
+PointCloud2ConstPtr Decoder::SweepCloud(Sweep& sweep,
+                                        const std_msgs::Header& header) {
+  return sweep.cloud.Get([&] {
+    return MakeCloud(sweep.scan, 0, sweep.scan.cols, header, sweep.config,
+                     ros::Duration(tf_timeout_), sweep.deskew, sweep.trig,
+                     false);
+  });
+}
+
+void Decoder::PublishCamera(const ScanBuffer& scan, int col_begin,
+                            int col_end, const std_msgs::Header& header,
+                            const CameraInfoConstPtr& cinfo_msg,
+                            const image_transport::CameraPublisher& pub) {
+  ScopedLatency latency(image_latency_);
+
+  const auto cols = col_end - col_begin;
+
+  // Header only views into the planes, no copy, read only
+  const auto view = [&](const std::vector<float>& plane) {
+    return cv::Mat(scan.rows, cols, CV_32FC1,
+                   const_cast<float*>(plane.data()) + col_begin,
+                   scan.stride * sizeof(float));
+  };
+  const cv::Mat planes[3] = {view(scan.range), view(scan.intensity),
+                             view(scan.azimuth)};
+
+  // Published image keeps the interleaved (range, intensity, azimuth) layout
+  const ImagePtr image_msg = image_pool_.Get();
+  cv::Mat image = ResizeImage(header, image_encodings::TYPE_32FC3, scan.rows,
+                              cols, CV_32FC3, *image_msg);
+  cv::merge(planes, 3, image);
+  pub.publish(image_msg, cinfo_msg);
+}
+
+void Decoder::PublishPacked(Sweep& sweep, const std_msgs::Header& header) {
+  if (packed_pub_.getNumSubscribers() == 0) return;
+  ScopedLatency latency(image_latency_);
+
+  const ImagePtr image_msg = packed_pool_.Get();
+  ToPacked(sweep.scan, 0, sweep.scan.cols, header, *image_msg);
+  packed_pub_.publish(image_msg, SweepCameraInfo(sweep, header));
+}
 
-  if (cloud_pub_.getNumSubscribers() > 0) {
-    cloud_pub_.publish(ToCloud(image_msg, *cinfo_msg, config_.organized));
+PointCloud2Ptr Decoder::MakeCloud(const ScanBuffer& scan, int col_begin,
+                                  int col_end, const std_msgs::Header& header,
+                                  const VelodynePuckConfig& config,
+                                  const ros::Duration& tf_timeout,
+                                  ColumnTransforms& transforms,
+                                  AzimuthTrig& trig, bool fill_trig) {
+  ScopedLatency latency(cloud_latency_);
+
+  CloudOptions options;
+  options.organized = config.organized;
+  options.precise = config.precise;
+  options.ring = config.ring;
+  options.time = config.time;
+  options.second = static_cast<CloudOptions::Second>(config.second_returns);
+  if (config.deskew &&
+      Deskew(scan, col_begin, col_end, tf_timeout, transforms)) {
+    options.deskew = &transforms;
   }
+  if (fill_trig || trig.cols > 0) options.trig = &trig;
+  options.fill_trig = fill_trig;
 
-  if (range_pub_.getNumSubscribers() > 0 ||
-      intensity_pub_.getNumSubscribers() > 0) {
-    // Publish range and intensity separately
-    cv::Mat sep[3];
-    cv::split(image_, sep);
+  const PointCloud2Ptr cloud_msg = cloud_pool_.Get();
+  cloud_msg->header = header;
+  ToCloud(scan, col_begin, col_end, Beams(scan), options, *cloud_msg);
+  return cloud_msg;
+}
 
-    cv::Mat range = sep[RANGE];
-    // should be 2, use 3 for more contrast
-    range.convertTo(range, CV_8UC1, 3.0);
-    range_pub_.publish(
-        cv_bridge::CvImage(header, image_encodings::MONO8, range).toImageMsg());
+bool Decoder::Deskew(const ScanBuffer& scan, int col_begin, int col_end,
+                     const ros::Duration& timeout,
+                     ColumnTransforms& transforms) {
+  if (!tf_buffer_) return false;
+  ScopedLatency latency(deskew_latency_);
+
+  // Only two lookups, poses in between are interpolated per column
+  const uint64_t times[2] = {scan.timestamps[col_begin],
+                             scan.timestamps[col_end - 1]};
+  Pose poses[2];
+  for (int i = 0; i < 2; ++i) {
+    const auto time = ros::Time().fromNSec(times[i]);
+    // Without a timeout check first, a missing pose is common then and not
+    // worth an exception
+    std::string error;
+    if (timeout.isZero() && !tf_buffer_->canTransform(fixed_frame_, frame_id_,
+                                                      time, timeout, &error)) {
+      ROS_WARN_THROTTLE(1, "Cloud not deskewed: %s", error.c_str());
+      return false;
+    }
+
+    geometry_msgs::TransformStamped tf;
+    try {
+      tf = tf_buffer_->lookupTransform(fixed_frame_, frame_id_, time, timeout);
+    } catch (const tf2::TransformException& e) {
+      ROS_WARN_THROTTLE(1, "Cloud not deskewed: %s", e.what());
+      return false;
+    }
+
+    const auto& q = tf.transform.rotation;
+    const auto& t = tf.transform.translation;
+    poses[i].qw = q.w;
+    poses[i].qx = q.x;
+    poses[i].qy = q.y;
+    poses[i].qz = q.z;
+    poses[i].x = t.x;
+    poses[i].y = t.y;
+    poses[i].z = t.z;
+  }
+
+  InterpolateColumns(poses[0], poses[1], scan.timestamps.data(), col_begin,
+                     col_end, transforms);
+  return true;
+}
+
+size_t Decoder::PoolHits() const {
+  return image_pool_.hits() + cinfo_pool_.hits() + range_pool_.hits() +
+         intensity_pool_.hits() + packed_pool_.hits() + cloud_pool_.hits();
+}
 
-    // use 300 for more contrast
-    cv::Mat intensity = sep[INTENSITY];
-    double a, b;
-    cv::minMaxIdx(intensity, &a, &b);
-    intensity.convertTo(intensity, CV_8UC1, 255 / (b - a), 255 * a / (a - b));
-    intensity_pub_.publish(
-        cv_bridge::CvImage(header, image_encodings::MONO8, intensity)
-            .toImageMsg());
+size_t Decoder::PoolMisses() const {
+  return image_pool_.misses() + cinfo_pool_.misses() + range_pool_.misses() +
+         intensity_pool_.misses() + packed_pool_.misses() +
+         cloud_pool_.misses();
+}
+
+void Decoder::DecodeDiagnostic(DiagnosticStatusWrapper& stat) {
+  const auto now = ros::WallTime::now();
+  const auto elapsed = std::max((now - prev_diag_time_).toSec(), 1e-3);
+  prev_diag_time_ = now;
+
+  size_t num_published, num_pending;
+  {
+    std::lock_guard<std::mutex> lock(sweeps_mutex_);
+    num_published = num_published_;
+    num_pending = num_written_ - num_published_;
+  }
+  const auto sweeps = num_published - prev_num_published_;
+  prev_num_published_ = num_published;
+
+  const auto& stats = decoder_.stats();
+  const auto lost = stats.lost_packets - prev_stats_.lost_packets;
+  const auto filled = stats.filled_columns - prev_stats_.filled_columns;
+  const auto resyncs = stats.resyncs - prev_stats_.resyncs;
+  prev_stats_ = stats;
+
+  const auto& c = counters_;
+  if (c.packets == 0) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN, "No packets");
+  } else if (c.late_packets > 0 || c.stalls > 0) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                 "Decoding falls behind");
+  } else if (lost > 0) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN, "Packets lost");
+  } else {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "Decoding ok");
   }
 
-  // Don't forget to reset
-  Reset();
-  ROS_DEBUG("Time: %f", (ros::Time::now() - start).toSec());
+  const auto expected_sweep_rate =
+      config_.full_sweep ? decoder_.rpm() / 60.0
+                         : kPacketsPerSecond * kSequencesPerPacket /
+                               std::max(config_.image_width, 1);
+
+  stat.add("Model", ModelName(decoder_.model()));
+  stat.add("Packets", c.packets);
+  stat.add("Packet rate [Hz]", c.packets / elapsed);
+  stat.add("Lost packets", lost);
+  stat.add("Filled columns", filled);
+  stat.add("Late packets", c.late_packets);
+  stat.add("Max packet backlog (estimated)", c.max_backlog);
+  stat.add("Sweeps published", sweeps);
+  stat.add("Sweep rate [Hz]", sweeps / elapsed);
+  stat.add("Expected sweep rate [Hz]", expected_sweep_rate);
+  stat.add("Sweeps pending", num_pending);
+  stat.add("Max sweeps pending", c.max_sweeps);
+  stat.add("Waits for a free sweep", c.stalls);
+  stat.add("Resyncs", resyncs);
+  stat.add("Pool misses", PoolMisses());
+
+  // Counters are per diagnostic period
+  counters_ = DecodeCounters{};
+}
+
+void Decoder::LatencyDiagnostic(DiagnosticStatusWrapper& stat) {
+  const auto add = [&stat](const std::string& name,
+                           LatencyHistogram& histogram) {
+    const auto s = histogram.Drain();
+    stat.addf(name, "n %zu, mean %.0f, p50 %.0f, p90 %.0f, p99 %.0f, max %.0f",
+              s.count, s.mean_us, s.p50_us, s.p90_us, s.p99_us, s.max_us);
+    return s;
+  };
+
+  // Time stamp to publish of one revolution
+  const auto sweep = add("Sweep end to end [us]", sweep_latency_);
+  add("Sector end to end [us]", sector_latency_);
+  add("Packet age [us]", packet_age_);
+  add("Decode per packet [us]", decode_latency_);
+  add("Cloud [us]", cloud_latency_);
+  add("Image [us]", image_latency_);
+  add("Deskew poses [us]", deskew_latency_);
+
+  const auto sweep_period_us = 6e7 / std::max(decoder_.rpm(), kMinRpm);
+  if (sweep.p99_us > sweep_period_us) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                 "Sweeps take longer than one revolution to publish");
+  } else {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "Latency ok");
+  }
 }
 
 void Decoder::ConfigCb(VelodynePuckConfig& config, int level) {
   config.min_range = std::min(config.min_range, config.max_range);
 
   if (config.full_sweep) {
-    config.full_sweep = false;
-    ROS_WARN("Full sweep mode not supported. Use the following image width");
-    ROS_WARN("5 rpm - 3600, 10 rpm - 1800, 20 rpm - 900");
+    ROS_INFO("Full sweep mode, cut at %f deg, image_width is ignored",
+             config.cut_angle);
+  }
+
+  if (config.sector_packets > 0) {
+    ROS_INFO("Sector mode, publish every %d packets", config.sector_packets);
+  } else if (config.sector_angle > 0) {
+    ROS_INFO("Sector mode, publish every %f deg", config.sector_angle);
   }
 
+  ROS_WARN_COND(config.deskew && fixed_frame_.empty(),
+                "Deskew needs ~fixed_frame, clouds are not deskewed");
+
   config.image_width /= kSequencesPerPacket;
   config.image_width *= kSequencesPerPacket;
 
   ROS_INFO(
       "Reconfigure Request: min_range: %f, max_range: %f, image_width: %d, "
-      "organized: %s, full_sweep: %s",
+      "organized: %s, full_sweep: %s, precise: %s",
       config.min_range, config.max_range, config.image_width,
       config.organized ? "True" : "False",
-      config.full_sweep ? "True" : "False");
+      config.full_sweep ? "True" : "False",
+      config.precise ? "True" : "False");
 
   config_ = config;
-  Reset();
+
+  DecodeOptions options;
+  options.min_range = config.min_range;
+  options.max_range = config.max_range;
+  // Limits are on the corrected range. A calibration is that of every model
+  // and nominal beams have no bias, so beams_ holds the bias of any sweep.
+  std::copy(std::begin(beams_.distance_bias), std::end(beams_.distance_bias),
+            std::begin(options.distance_bias));
+  options.image_width = config.image_width;
+  options.full_sweep = config.full_sweep;
+  options.cut_angle = config.cut_angle;
+  options.sector_angle = config.sector_angle;
+  options.sector_packets = config.sector_packets;
+  decoder_.Reset(&sweep_->scan, options);
 
   if (level < 0) {
     ROS_INFO("Initialize ROS subscriber/publisher...");
     camera_pub_ = it_.advertiseCamera("image", 10);
+    packed_pub_ = it_.advertiseCamera("packed/image", 10);
     cloud_pub_ = pnh_.advertise<PointCloud2>("cloud", 10);
     intensity_pub_ = it_.advertise("intensity", 1);
     range_pub_ = it_.advertise("range", 1);
+    sector_camera_pub_ = it_.advertiseCamera("sector/image", 10);
+    sector_cloud_pub_ = pnh_.advertise<PointCloud2>("sector/cloud", 10);
 
     packet_sub_ =
         pnh_.subscribe<VelodynePacket>("packet", 256, &Decoder::PacketCb, this);
+    // Driver publishes either packets or whole scans
+    scan_sub_ =
+        pnh_.subscribe<VelodyneScan>("scan", 10, &Decoder::ScanCb, this);
     ROS_INFO("Decoder initialized");
   }
 }
 
-void Decoder::Reset() {
-  curr_col_ = 0;
-  image_ = cv::Mat(kFiringsPerSequence, config_.image_width, CV_32FC3,
-                   cv::Scalar(kNaNF));
-  azimuths_.clear();
-  azimuths_.resize(config_.image_width, kNaND);
-  timestamps_.clear();
-  timestamps_.resize(config_.image_width, 0);
+std::vector<std::unique_ptr<Decoder>> MakeDecoders(
+    const ros::NodeHandle& pnh) {
+  std::vector<std::unique_ptr<Decoder>> decoders;
+
+  std::vector<std::string> names;
+  if (!pnh.getParam("sensors", names)) {
+    decoders.emplace_back(new Decoder(pnh));
+    return decoders;
+  }
+
+  for (const auto& name : names) {
+    ROS_INFO("Decoder for sensor: %s", name.c_str());
+    decoders.emplace_back(new Decoder(ros::NodeHandle(pnh, name), name));
+  }
+  return decoders;
+}
+
+/// cos and sin of azimuth theta, exact or looked up at the nearest raw azimuth
+inline void AzimuthCosSin(float theta, bool precise, float& cos_theta,
+                          float& sin_theta) {
+  if (precise) {
+    cos_theta = std::cos(theta);
+    sin_theta = std::sin(theta);
+  } else {
+    const auto& table = GetAzimuthTable();
+    const auto raw = Azimuth2Raw(theta);
+    cos_theta = table.cos[raw];
+    sin_theta = table.sin[raw];
+  }
+}
+
+/// Point cloud of a packed image, see ToPacked
+CloudT PackedToCloud(const ImageConstPtr& image_msg,
+                     const CameraInfo& cinfo_msg, const BeamTable& beams,
+                     bool organized, bool precise) {
+  CloudT cloud;
+  const auto image = cv_bridge::toCvShare(image_msg)->image;
+  // D = [elevations, azimuths], elevations are those of beams
+  const auto* azimuths = cinfo_msg.D.data() + image.rows;
+  if (cinfo_msg.D.size() != static_cast<size_t>(image.rows + image.cols)) {
+    ROS_WARN("Camera info D has %zu elements, image is %d x %d",
+             cinfo_msg.D.size(), image.rows, image.cols);
+    return cloud;
+  }
+
+  // Firings of a column are spread over the azimuth step to the next column,
+  // as when decoding. The last column has no next one, take the previous.
+  std::vector<float> firing_gaps(image.cols, 0);
+  for (int c = 0; c + 1 < image.cols; ++c) {
+    auto step = azimuths[c + 1] - azimuths[c];
+    if (step < 0) step += kTau;
+    firing_gaps[c] = kSingleFiringRatio * step;
+  }
+  if (image.cols > 1) firing_gaps.back() = firing_gaps[image.cols - 2];
+
+  cloud.header = pcl_conversions::toPCL(image_msg->header);
+  cloud.reserve(image.total());
+
+  for (int r = 0; r < image.rows; ++r) {
+    const auto* const row_ptr = image.ptr<cv::Vec3b>(r);
+    // Because image row 0 is the highest laser point
+    const auto beam = beams.Row(r);
+    const auto lid = kRow2LaserId[r];
+
+    for (int c = 0; c < image.cols; ++c) {
+      const cv::Vec3b& data = row_ptr[c];
+      const uint16_t raw = data[0] | (data[1] << 8);
+
+      PointT p;
+      if (raw == 0) {
+        if (organized) {
+          p.x = p.y = p.z = p.intensity = kNaNF;
+          cloud.points.push_back(p);
+        }
+      } else {
+        const float d = raw * kDistanceResolution;
+        const float azimuth =
+            azimuths[c] + lid * firing_gaps[c] + beam.azimuth_offset;
+        float cos_theta, sin_theta;
+        AzimuthCosSin(azimuth, precise, cos_theta, sin_theta);
+
+        beam.Point(d, cos_theta, sin_theta, p.x, p.y, p.z);
+        p.intensity = data[2];
+        cloud.points.push_back(p);
+      }
+    }
+  }
+
+  if (organized) {
+    cloud.width = image.cols;
+    cloud.height = image.rows;
+  } else {
+    cloud.width = cloud.size();
+    cloud.height = 1;
+  }
+
+  return cloud;
 }
 
 CloudT ToCloud(const ImageConstPtr& image_msg, const CameraInfo& cinfo_msg,
-               bool organized) {
+               const BeamTable& beams, bool organized, bool precise) {
+  if (image_msg->height != kFiringsPerSequence) {
+    ROS_WARN("Image has %u rows, not one per laser", image_msg->height);
+    return CloudT();
+  }
+  if (image_msg->encoding == image_encodings::TYPE_8UC3) {
+    return PackedToCloud(image_msg, cinfo_msg, beams, organized, precise);
+  }
+
   CloudT cloud;
   const auto image = cv_bridge::toCvShare(image_msg)->image;
-  const auto& elevations = cinfo_msg.D;  // might be unsafe
 
   cloud.header = pcl_conversions::toPCL(image_msg->header);
   cloud.reserve(image.total());
@@ -333,9 +903,7 @@ CloudT ToCloud(const ImageConstPtr& image_msg, const CameraInfo& cinfo_msg,
   for (int r = 0; r < image.rows; ++r) {
     const auto* const row_ptr = image.ptr<cv::Vec3f>(r);
     // Because image row 0 is the highest laser point
-    const auto phi = elevations[r];
-    const auto cos_phi = std::cos(phi);
-    const auto sin_phi = std::sin(phi);
+    const auto beam = beams.Row(r);
 
     for (int c = 0; c < image.cols; ++c) {
       const cv::Vec3f& data = row_ptr[c];
@@ -347,15 +915,11 @@ CloudT ToCloud(const ImageConstPtr& image_msg, const CameraInfo& cinfo_msg,
           cloud.points.push_back(p);
         }
       } else {
-        const auto d = data[RANGE];
-        const auto theta = data[AZIMUTH];
-        const auto x = d * cos_phi * std::cos(theta);
-        const auto y = d * cos_phi * std::sin(theta);
-        const auto z = d * sin_phi;
-
-        p.x = x;
-        p.y = -y;
-        p.z = z;
+        float cos_theta, sin_theta;
+        AzimuthCosSin(data[AZIMUTH] + beam.azimuth_offset, precise, cos_theta,
+                      sin_theta);
+
+        beam.Point(data[RANGE], cos_theta, sin_theta, p.x, p.y, p.z);
         p.intensity = data[INTENSITY];
 
         cloud.points.push_back(p);
@@ -374,12 +938,255 @@ CloudT ToCloud(const ImageConstPtr& image_msg, const CameraInfo& cinfo_msg,
   return cloud;
 }
 
-}  // namespace velodyne_puck
+CloudT ToCloud(const ImageConstPtr& image_msg, const CameraInfo& cinfo_msg,
+               bool organized, bool precise) {
+  // D = [elevations, ...], see MakeCameraInfo
+  const int rows =
+      std::min(kFiringsPerSequence, static_cast<int>(cinfo_msg.D.size()));
+  std::vector<LaserCorrection> lasers;
+  for (int r = 0; r < rows; ++r) {
+    LaserCorrection laser;
+    laser.laser_id = kRow2LaserId[r];
+    laser.vert_correction = cinfo_msg.D[r];
+    lasers.push_back(laser);
+  }
+  return ToCloud(image_msg, cinfo_msg, BeamTable(lasers), organized, precise);
+}
 
-int main(int argc, char** argv) {
-  ros::init(argc, argv, "velodyne_puck_decoder");
-  ros::NodeHandle pnh("~");
+/// Point fields of columns [col_begin, col_end) of scan written from out on,
+/// returns the end of the last point. With kDual organized second returns go
+/// one layer of points below the first. Each row is first computed as planes
+/// of x, y and z, which deskew transforms with vector instructions, then
+/// interleaved into points.
+template <bool kDual>
+uint8_t* WriteCloud(const ScanBuffer& scan, int col_begin, int col_end,
+                    const BeamTable& beams,
+                    const CloudOptions& options, uint32_t point_step,
+                    uint32_t time_offset, uint32_t ring_offset, uint8_t* out) {
+  const bool differing = options.second == CloudOptions::Second::kDiffering;
+  const auto* deskew = options.deskew;
+  auto* trig = options.trig;
+  const int cached_cols = trig ? trig->cols : 0;
+  const bool fill_trig = trig && options.fill_trig && col_begin <= trig->cols;
+  const auto start_ns = scan.timestamps[col_begin];
+  const int cols = col_end - col_begin;
+  const auto layer_step = static_cast<size_t>(scan.rows) * cols * point_step;
+
+  // x, y and z planes of one row per return, NaN if there is none. Clouds
+  // are written by the decode thread and the publish workers, each keeps its
+  // own.
+  constexpr int kLayers = kDual ? 2 : 1;
+  thread_local std::vector<float> row_planes;
+  row_planes.resize(static_cast<size_t>(kLayers) * 3 * cols);
+  float* xyz[kLayers][3];
+  for (int l = 0; l < kLayers; ++l) {
+    for (int k = 0; k < 3; ++k) xyz[l][k] = &row_planes[(l * 3 + k) * cols];
+  }
+
+  for (int r = 0; r < scan.rows; ++r) {
+    const auto* range = scan.RangeRow(r);
+    const auto* intensity = scan.IntensityRow(r);
+    const auto* azimuth = scan.AzimuthRow(r);
+    const auto* range2 = kDual ? scan.Range2Row(r) : nullptr;
+    const auto* intensity2 = kDual ? scan.Intensity2Row(r) : nullptr;
+    // Constants of the beam, row 0 is the highest laser
+    const auto beam = beams.Row(r);
+    const uint16_t ring = scan.rows - 1 - r;
+    const auto firing_ns = kRow2LaserId[r] * kSingleFiringNs;
+    auto* trig_cos = trig ? &trig->cos[scan.Index(r, 0)] : nullptr;
+    auto* trig_sin = trig ? &trig->sin[scan.Index(r, 0)] : nullptr;
+
+    for (int c = col_begin; c < col_end; ++c) {
+      const int i = c - col_begin;
+      const auto d = range[c];
+      auto d2 = kNaNF;
+      if (kDual) {
+        d2 = range2[c];
+        if (differing && d2 == d && intensity2[c] == intensity[c]) d2 = kNaNF;
+      }
 
-  velodyne_puck::Decoder node(pnh);
-  ros::spin();
+      // Both returns share the trig of their firing
+      const bool valid = !std::isnan(d);
+      const bool valid2 = kDual && !std::isnan(d2);
+      float cos_theta = 0, sin_theta = 0;
+      if ((valid || valid2) && c < cached_cols) {
+        cos_theta = trig_cos[c];
+        sin_theta = trig_sin[c];
+      } else if (valid || valid2) {
+        AzimuthCosSin(azimuth[c] + beam.azimuth_offset, options.precise,
+                      cos_theta, sin_theta);
+        if (fill_trig) {
+          trig_cos[c] = cos_theta;
+          trig_sin[c] = sin_theta;
+        }
+      }
+
+      const auto point = [&](float range, float* const* plane) {
+        if (std::isnan(range)) {
+          plane[0][i] = plane[1][i] = plane[2][i] = kNaNF;
+          return;
+        }
+        beam.Point(range, cos_theta, sin_theta, plane[0][i], plane[1][i],
+                   plane[2][i]);
+      };
+      point(d, xyz[0]);
+      if (kDual) point(d2, xyz[kLayers - 1]);
+    }
+
+    if (deskew) {
+      for (int l = 0; l < kLayers; ++l) {
+        ApplyColumnTransforms(*deskew, col_begin, col_end, xyz[l][0],
+                              xyz[l][1], xyz[l][2]);
+      }
+    }
+
+    for (int c = col_begin; c < col_end; ++c) {
+      const int i = c - col_begin;
+      const auto write = [&](uint8_t* point, int layer, float intensity) {
+        float xyzi[4] = {xyz[layer][0][i], xyz[layer][1][i], xyz[layer][2][i],
+                         intensity};
+        if (std::isnan(xyzi[0])) xyzi[3] = kNaNF;
+        std::memcpy(point, xyzi, sizeof(xyzi));
+        if (options.time) {
+          // Signed, stamps of a resynced sweep need not grow
+          const auto column_ns =
+              static_cast<int64_t>(scan.timestamps[c] - start_ns);
+          const float time = (column_ns + firing_ns) * 1e-9;  // [s]
+          std::memcpy(point + time_offset, &time, sizeof(time));
+        }
+        if (options.ring) {
+          std::memcpy(point + ring_offset, &ring, sizeof(ring));
+        }
+      };
+
+      if (options.organized) {
+        write(out, 0, intensity[c]);
+        if (kDual) write(out + layer_step, kLayers - 1, intensity2[c]);
+        out += point_step;
+        continue;
+      }
+
+      if (!std::isnan(xyz[0][0][i])) {
+        write(out, 0, intensity[c]);
+        out += point_step;
+      }
+      if (kDual && !std::isnan(xyz[kLayers - 1][0][i])) {
+        write(out, kLayers - 1, intensity2[c]);
+        out += point_step;
+      }
+    }
+  }
+  return out;
+}
+
+void ToCloud(const ScanBuffer& scan, int col_begin, int col_end,
+             const BeamTable& beams, const CloudOptions& options,
+             PointCloud2& cloud) {
+  // Tightly packed fields, no padding
+  cloud.fields.clear();
+  uint32_t offset = 0;
+  const auto add_field = [&cloud, &offset](const std::string& name,
+                                           uint8_t datatype, uint32_t size) {
+    PointField field;
+    field.name = name;
+    field.offset = offset;
+    field.datatype = datatype;
+    field.count = 1;
+    cloud.fields.push_back(field);
+    offset += size;
+  };
+  add_field("x", PointField::FLOAT32, sizeof(float));
+  add_field("y", PointField::FLOAT32, sizeof(float));
+  add_field("z", PointField::FLOAT32, sizeof(float));
+  add_field("intensity", PointField::FLOAT32, sizeof(float));
+  const auto time_offset = offset;
+  if (options.time) add_field("time", PointField::FLOAT32, sizeof(float));
+  const auto ring_offset = offset;
+  if (options.ring) add_field("ring", PointField::UINT16, sizeof(uint16_t));
+
+  cloud.is_bigendian = false;
+  cloud.point_step = offset;
+  // Invalid points were already set to NaN and counted while decoding, the
+  // count is only known for the whole scan
+  const auto cols = col_end - col_begin;
+  const auto num_slice = static_cast<size_t>(scan.rows) * cols;
+  const bool whole = col_begin == 0 && col_end == scan.cols;
+  const bool dual =
+      scan.layers > 1 && options.second != CloudOptions::Second::kNone;
+  const int layers = dual ? 2 : 1;
+  const size_t max_points =
+      options.organized || !whole
+          ? num_slice * layers
+          : scan.num_valid + (dual ? scan.num_valid2 : 0);
+  cloud.data.resize(max_points * cloud.point_step);
+
+  // Cached trig is only good for the same kind of azimuth of the same sweep,
+  // the packet decoder starts sweeps over on its own, e.g. at the first cut
+  // or on a resync
+  auto* trig = options.trig;
+  if (trig) {
+    if (trig->precise != options.precise || trig->sweep_id != scan.sweep_id) {
+      trig->cols = 0;
+      trig->precise = options.precise;
+      trig->sweep_id = scan.sweep_id;
+    }
+    const auto size = static_cast<size_t>(scan.rows) * scan.stride;
+    if (trig->cos.size() < size) {
+      trig->cos.resize(size);
+      trig->sin.resize(size);
+    }
+  }
+
+  const auto* begin = cloud.data.data();
+  const auto* end =
+      dual ? WriteCloud<true>(scan, col_begin, col_end, beams, options,
+                              cloud.point_step, time_offset, ring_offset,
+                              cloud.data.data())
+           : WriteCloud<false>(scan, col_begin, col_end, beams, options,
+                               cloud.point_step, time_offset, ring_offset,
+                               cloud.data.data());
+  if (trig && options.fill_trig && col_begin <= trig->cols) {
+    trig->cols = std::max(trig->cols, col_end);
+  }
+
+  const auto num_points = options.organized
+                              ? num_slice * layers
+                              : (end - begin) / cloud.point_step;
+  cloud.data.resize(num_points * cloud.point_step);
+
+  if (options.organized) {
+    cloud.width = cols;
+    cloud.height = scan.rows * layers;
+  } else {
+    cloud.width = num_points;
+    cloud.height = 1;
+  }
+  cloud.row_step = cloud.width * cloud.point_step;
+  cloud.is_dense = !options.organized;
 }
+
+void ToPacked(const ScanBuffer& scan, int col_begin, int col_end,
+              const std_msgs::Header& header, Image& image) {
+  const auto cols = col_end - col_begin;
+  ResizeImage(header, image_encodings::TYPE_8UC3, scan.rows, cols, CV_8UC3,
+              image);
+  // Ranges are multiples of kDistanceResolution, rounding is exact
+  static constexpr float kScale = 1 / kDistanceResolution;
+
+  for (int r = 0; r < scan.rows; ++r) {
+    const auto* range = scan.RangeRow(r) + col_begin;
+    const auto* intensity = scan.IntensityRow(r) + col_begin;
+    auto* out = image.data.data() + r * image.step;
+
+    for (int c = 0; c < cols; ++c, out += 3) {
+      const auto d = range[c];
+      const uint16_t raw =
+          std::isnan(d) ? 0 : static_cast<uint16_t>(d * kScale + 0.5f);
+      out[0] = raw & 0xff;
+      out[1] = raw >> 8;
+      out[2] = raw == 0 ? 0 : static_cast<uint8_t>(intensity[c]);
+    }
+  }
+}
+
+}  // namespace velodyne_puck
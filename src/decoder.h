@@ -0,0 +1,347 @@
+#pragma once
+
+#include "calibration.h"
+#include "constants.h"
+#include "deskew.h"
+#include "latency.h"
+#include "packet_decoder.h"
+#include "pool.h"
+#include "scan.h"
+
+#include <diagnostic_updater/diagnostic_updater.h>
+#include <dynamic_reconfigure/server.h>
+#include <image_transport/camera_publisher.h>
+#include <image_transport/image_transport.h>
+#include <opencv2/core/core.hpp>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <ros/callback_queue.h>
+#include <ros/ros.h>
+#include <tf2_ros/buffer.h>
+#include <tf2_ros/transform_listener.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <sensor_msgs/CameraInfo.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <velodyne_msgs/VelodynePacket.h>
+#include <velodyne_msgs/VelodyneScan.h>
+#include <velodyne_puck/VelodynePuckConfig.h>
+
+namespace velodyne_puck {
+
+using PointT = pcl::PointXYZI;
+using CloudT = pcl::PointCloud<PointT>;
+
+/// Convert image and camera_info to point cloud with the beam geometry of
+/// beams, which must be that of the decoder publishing the image to match its
+/// cloud, e.g. from LoadCalibration() of the same calibration. If not
+/// precise azimuth is snapped to the raw azimuth grid and sin/cos are looked
+/// up in a table. image is either the 32FC3 image or the packed 8UC3 one of
+/// ToPacked, whose firing azimuths are interpolated from the column azimuths
+/// in D.
+CloudT ToCloud(const sensor_msgs::ImageConstPtr& image_msg,
+               const sensor_msgs::CameraInfo& cinfo_msg,
+               const BeamTable& beams, bool organized, bool precise = true);
+
+/// Same with only the elevations in D and no other corrections, which
+/// matches the cloud of a decoder without calibration
+CloudT ToCloud(const sensor_msgs::ImageConstPtr& image_msg,
+               const sensor_msgs::CameraInfo& cinfo_msg, bool organized,
+               bool precise = true);
+
+/// Beam geometry from the laser corrections in calibration/lasers of nh, as
+/// loaded from a calibration yaml of velodyne_pointcloud. False and beams
+/// left alone if there are none or they are invalid.
+bool LoadCalibration(const ros::NodeHandle& nh, BeamTable& beams);
+
+/// cos and sin of the azimuth of each firing of columns [0, cols) of a scan,
+/// rows x stride planes like those of the scan. Only set for valid points.
+struct AzimuthTrig {
+  std::vector<float> cos, sin;
+  int cols{0};
+  bool precise{true};    // see ToCloud above
+  uint64_t sweep_id{0};  // of the scan, see ScanBuffer::sweep_id
+};
+
+struct CloudOptions {
+  /// Which second returns of a dual return scan go into the cloud
+  enum class Second {
+    kNone,
+    kDiffering,  // only those not equal to the first return
+    kAll,
+  };
+
+  bool organized{true};  // keep invalid points as NaN
+  bool precise{true};    // see ToCloud above
+  bool time{false};      // float32 time [s] since header stamp
+  bool ring{false};      // uint16 ring, 0 is the bottom laser
+  Second second{Second::kDiffering};
+  /// Transform of each column of the scan applied to its points, none if
+  /// nullptr
+  const ColumnTransforms* deskew{nullptr};
+  /// Trig of columns before trig->cols is taken from it instead of computed.
+  /// With fill_trig computed trig extends it, if the columns follow on. None
+  /// if nullptr.
+  AzimuthTrig* trig{nullptr};
+  bool fill_trig{false};
+};
+
+/// Write scan buffer straight into a PointCloud2 in one pass over the range,
+/// intensity and azimuth planes, with the geometry of beams. Fields are
+/// tightly packed float32 x, y, z, intensity followed by the optional ones,
+/// header is left to the caller. Only columns [col_begin, col_end) are
+/// converted, time is relative to col_begin. Second returns of a dual return
+/// scan share sin/cos with the first, an organized cloud then has their rows
+/// below the first returns.
+void ToCloud(const ScanBuffer& scan, int col_begin, int col_end,
+             const BeamTable& beams, const CloudOptions& options,
+             sensor_msgs::PointCloud2& cloud);
+
+inline void ToCloud(const ScanBuffer& scan, const BeamTable& beams,
+                    const CloudOptions& options,
+                    sensor_msgs::PointCloud2& cloud) {
+  ToCloud(scan, 0, scan.cols, beams, options, cloud);
+}
+
+/// Set up image as rows x cols of type, reusing its data buffer, and return a
+/// cv::Mat header over that buffer. OpenCV functions writing to the header
+/// with the same size and type (e.g. cv::merge, convertTo) fill the message
+/// in place, anything else reallocates the header away from it.
+cv::Mat ResizeImage(const std_msgs::Header& header, const std::string& encoding,
+                    int rows, int cols, int type, sensor_msgs::Image& image);
+
+/// Pack columns [col_begin, col_end) of scan into a rows x cols 8UC3 image
+/// of 3 bytes per pixel, little-endian uint16 range in kDistanceResolution
+/// followed by uint8 intensity. Ranges are the raw distances of the packets,
+/// so this is lossless. No return is all zero. Azimuths are left to the
+/// camera info.
+void ToPacked(const ScanBuffer& scan, int col_begin, int col_end,
+              const std_msgs::Header& header, sensor_msgs::Image& image);
+
+/// Used for indexing into packet and image, (NOISE not used now)
+enum Index { RANGE = 0, INTENSITY = 1, AZIMUTH = 2, NOISE = 3 };
+
+class Decoder {
+ public:
+  /// Number of channels for image data
+  static constexpr int kChannels = 2;  // (range [m], intensity)
+
+  /// Diagnostics of a named sensor are prefixed with name
+  explicit Decoder(const ros::NodeHandle& pnh, const std::string& name = "");
+  ~Decoder();
+
+  Decoder(const Decoder&) = delete;
+  Decoder operator=(const Decoder&) = delete;
+
+  /// Message buffers reused from the pools and newly allocated ones
+  size_t PoolHits() const;
+  size_t PoolMisses() const;
+
+  void PacketCb(const velodyne_msgs::VelodynePacketConstPtr& packet_msg);
+  void ScanCb(const velodyne_msgs::VelodyneScanConstPtr& scan_msg);
+  void ConfigCb(VelodynePuckConfig& config, int level);
+
+ private:
+  /// Decode one packet, sweeps and sectors are handed out by decoder_
+  void DecodePacket(const velodyne_msgs::VelodynePacket& packet);
+
+  /// Product of a sweep, computed at most once by the first consumer that
+  /// asks for it and then shared as a const message until Reset()
+  template <typename T>
+  class SweepProduct {
+   public:
+    using ConstPtr = boost::shared_ptr<const T>;
+
+    /// The product, made by make() if no one asked for it yet
+    template <typename Make>
+    ConstPtr Get(const Make& make) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!product_) product_ = make();
+      return product_;
+    }
+
+    /// Drop the product, it goes back to its pool once subscribers release it
+    void Reset() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      product_.reset();
+    }
+
+   private:
+    std::mutex mutex_;
+    ConstPtr product_;
+  };
+
+  /// One entry of the sweep ring, config is the one the sweep was decoded
+  /// with
+  struct Sweep {
+    ScanBuffer scan;
+    VelodynePuckConfig config;
+    ros::Time received;  // stamp of the packet that completed the sweep
+    int num_done{0};     // products published so far
+    ColumnTransforms deskew;  // only used by the cloud task
+
+    // Computed once on demand and shared by every consumer of the sweep,
+    // released with the sweep. Camera info of image and packed image, the
+    // 8-bit range and intensity views, and the cloud. Trig of what the
+    // sector clouds covered, for the sweep cloud.
+    SweepProduct<sensor_msgs::CameraInfo> cinfo;
+    SweepProduct<sensor_msgs::Image> range, intensity;
+    SweepProduct<sensor_msgs::PointCloud2> cloud;
+    AzimuthTrig trig;
+
+    void ResetProducts() {
+      cinfo.Reset();
+      range.Reset();
+      intensity.Reset();
+      cloud.Reset();
+    }
+  };
+
+  /// Everything published per sweep, each is an independent task for the
+  /// publish workers
+  enum class Product { kCamera, kCloud, kRange, kIntensity, kPacked };
+  static constexpr int kNumProducts = 5;
+
+  /// Hand scan, the current sweep, to the publish workers and return the
+  /// next free buffer of the ring, only waits if all other buffers are still
+  /// publishing
+  ScanBuffer* FinishSweep(ScanBuffer& scan);
+  void PublishLoop();
+  void PublishSweep(Sweep& sweep, Product product);
+
+  /// Publish columns [col_begin, col_end) of the sweep being decoded right
+  /// away
+  void PublishSector(const ScanBuffer& scan, int col_begin, int col_end);
+
+  /// Camera info of columns [col_begin, col_end) of scan, roi holds the
+  /// column range
+  sensor_msgs::CameraInfoPtr MakeCameraInfo(const ScanBuffer& scan,
+                                            int col_begin, int col_end,
+                                            const std_msgs::Header& header);
+  /// Products of the whole sweep, each made at most once, see Sweep
+  sensor_msgs::CameraInfoConstPtr SweepCameraInfo(
+      Sweep& sweep, const std_msgs::Header& header);
+  sensor_msgs::ImageConstPtr SweepRange(Sweep& sweep,
+                                        const std_msgs::Header& header);
+  sensor_msgs::ImageConstPtr SweepIntensity(Sweep& sweep,
+                                            const std_msgs::Header& header);
+  sensor_msgs::PointCloud2ConstPtr SweepCloud(Sweep& sweep,
+                                              const std_msgs::Header& header);
+  /// Publish columns [col_begin, col_end) of scan as image and camera info
+  void PublishCamera(const ScanBuffer& scan, int col_begin, int col_end,
+                     const std_msgs::Header& header,
+                     const sensor_msgs::CameraInfoConstPtr& cinfo_msg,
+                     const image_transport::CameraPublisher& pub);
+  /// Publish sweep as packed image and camera info, see ToPacked
+  void PublishPacked(Sweep& sweep, const std_msgs::Header& header);
+  /// Cloud of columns [col_begin, col_end) of scan. tf_timeout is how long
+  /// deskew may wait for a pose, transforms is scratch space for deskew, trig
+  /// the azimuth trig cache of the sweep, filled by sectors before it is
+  /// converted whole.
+  sensor_msgs::PointCloud2Ptr MakeCloud(const ScanBuffer& scan, int col_begin,
+                                        int col_end,
+                                        const std_msgs::Header& header,
+                                        const VelodynePuckConfig& config,
+                                        const ros::Duration& tf_timeout,
+                                        ColumnTransforms& transforms,
+                                        AzimuthTrig& trig, bool fill_trig);
+
+  /// Beam geometry of the sensor model of scan
+  const BeamTable& Beams(const ScanBuffer& scan) const {
+    return scan.model == Model::kPuckHiRes ? hi_res_beams_ : beams_;
+  }
+
+  /// Transforms of columns [col_begin, col_end) of scan into the sensor frame
+  /// at col_begin, from the poses of frame_id_ in fixed_frame_ at the first
+  /// and last column. False if tf has no such poses within timeout, a zero
+  /// timeout never blocks.
+  bool Deskew(const ScanBuffer& scan, int col_begin, int col_end,
+              const ros::Duration& timeout, ColumnTransforms& transforms);
+
+  // ROS related parameters, all callbacks of pnh_ (packets, scans and
+  // reconfigure) are called in order by one spinner thread per decoder
+  std::string frame_id_;
+  ros::CallbackQueue queue_;
+  ros::AsyncSpinner spinner_;
+  ros::NodeHandle pnh_;
+  image_transport::ImageTransport it_;
+  ros::Subscriber packet_sub_, scan_sub_;
+  ros::Publisher cloud_pub_;
+  image_transport::Publisher intensity_pub_, range_pub_;
+  image_transport::CameraPublisher camera_pub_, packed_pub_;
+  ros::Publisher sector_cloud_pub_;
+  image_transport::CameraPublisher sector_camera_pub_;
+  dynamic_reconfigure::Server<VelodynePuckConfig> cfg_server_;
+  VelodynePuckConfig config_;
+
+  // Ring of preallocated sweeps, sweeps_[num_written_ % size] is being
+  // decoded, [num_published_, num_written_) are waiting for or being
+  // published. Task t publishes product t % kNumProducts of sweep
+  // t / kNumProducts, tasks before next_task_ are taken by a worker.
+  std::vector<Sweep> sweeps_;
+  Sweep* sweep_{nullptr};
+  size_t num_written_{0};
+  size_t num_published_{0};
+  size_t next_task_{0};
+  bool stop_{false};
+  std::mutex sweeps_mutex_;
+  std::condition_variable sweeps_cv_;
+  std::vector<std::thread> publish_threads_;
+
+  // Published messages go back to these once all subscribers release them
+  Pool<sensor_msgs::Image> image_pool_, range_pool_, intensity_pool_;
+  Pool<sensor_msgs::Image> packed_pool_;
+  Pool<sensor_msgs::CameraInfo> cinfo_pool_;
+  Pool<sensor_msgs::PointCloud2> cloud_pool_;
+
+  // Per beam geometry of the VLP-16 and the Puck Hi-Res, or the calibrated
+  // one for both. Not changed after construction.
+  BeamTable beams_;
+  BeamTable hi_res_beams_;
+
+  // Deskew, only if fixed_frame_ is set
+  std::string fixed_frame_;
+  double tf_timeout_{0.05};  // [s] sweeps wait for the last pose
+  std::unique_ptr<tf2_ros::Buffer> tf_buffer_;
+  std::unique_ptr<tf2_ros::TransformListener> tf_listener_;
+  ColumnTransforms sector_deskew_;
+
+  /// Decode thread counters, reset every diagnostic period
+  struct DecodeCounters {
+    size_t packets{0};
+    size_t late_packets{0};  // older than kLatePacketAge when decoded
+    double max_backlog{0};   // packets queued ahead of us, from packet age
+    size_t stalls{0};        // waits for a free sweep
+    size_t max_sweeps{0};    // sweeps written but not yet published
+  };
+
+  void DecodeDiagnostic(diagnostic_updater::DiagnosticStatusWrapper& stat);
+  void LatencyDiagnostic(diagnostic_updater::DiagnosticStatusWrapper& stat);
+
+  // Diagnostics, updated by a timer on the decode thread. Publish workers
+  // only touch the histograms, which are lock free.
+  diagnostic_updater::Updater updater_;
+  ros::WallTimer diag_timer_;
+  DecodeCounters counters_;
+  DecodeStats prev_stats_;
+  size_t prev_num_published_{0};
+  ros::WallTime prev_diag_time_;
+  ros::Time packet_stamp_;  // of the packet being decoded
+  LatencyHistogram decode_latency_, cloud_latency_, image_latency_;
+  LatencyHistogram packet_age_, sweep_latency_, sector_latency_;
+  LatencyHistogram deskew_latency_;
+
+  PacketDecoder decoder_;
+};
+
+/// Decoders of the sensors in ~sensors, each configured and publishing in
+/// ~<name>/, or a single one in pnh if there is no such list. Each decodes on
+/// its own thread.
+std::vector<std::unique_ptr<Decoder>> MakeDecoders(const ros::NodeHandle& pnh);
+
+}  // namespace velodyne_puck
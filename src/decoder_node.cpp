@@ -0,0 +1,10 @@
+#include "decoder.h"
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "velodyne_puck_decoder");
+  ros::NodeHandle pnh("~");
+
+  // Decoders run on their own spinner threads
+  const auto decoders = velodyne_puck::MakeDecoders(pnh);
+  ros::spin();
+}
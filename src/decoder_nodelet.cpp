@@ -0,0 +1,22 @@
+#include "decoder.h"
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include <memory>
+
+namespace velodyne_puck {
+
+/// Decoder loaded into the same manager as DriverNodelet receives each
+/// VelodynePacketConstPtr by pointer instead of through TCPROS. Decoding runs
+/// on one thread per sensor instead of the manager's worker threads.
+class DecoderNodelet : public nodelet::Nodelet {
+ private:
+  void onInit() override { decoders_ = MakeDecoders(getPrivateNodeHandle()); }
+
+  std::vector<std::unique_ptr<Decoder>> decoders_;
+};
+
+}  // namespace velodyne_puck
+
+PLUGINLIB_EXPORT_CLASS(velodyne_puck::DecoderNodelet, nodelet::Nodelet)
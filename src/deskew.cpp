@@ -0,0 +1,209 @@
+#include "deskew.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VELODYNE_PUCK_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VELODYNE_PUCK_NEON 1
+#endif
+
+namespace velodyne_puck {
+
+/// Rotation matrix of unit quaternion (w, x, y, z), row-major
+inline void QuaternionToMatrix(double w, double x, double y, double z,
+                               float* r) {
+  r[0] = 1 - 2 * (y * y + z * z);
+  r[1] = 2 * (x * y - w * z);
+  r[2] = 2 * (x * z + w * y);
+  r[3] = 2 * (x * y + w * z);
+  r[4] = 1 - 2 * (x * x + z * z);
+  r[5] = 2 * (y * z - w * x);
+  r[6] = 2 * (x * z - w * y);
+  r[7] = 2 * (y * z + w * x);
+  r[8] = 1 - 2 * (x * x + y * y);
+}
+
+void InterpolateColumns(const Pose& start, const Pose& end,
+                        const uint64_t* timestamps, int col_begin, int col_end,
+                        ColumnTransforms& transforms) {
+  if (transforms.size() < static_cast<size_t>(col_end)) {
+    transforms.resize(col_end);
+  }
+  if (col_begin >= col_end) return;
+
+  // Relative rotation q = conj(start) * end, on the short way around
+  auto w = start.qw * end.qw + start.qx * end.qx + start.qy * end.qy +
+           start.qz * end.qz;
+  auto x = start.qw * end.qx - start.qx * end.qw - start.qy * end.qz +
+           start.qz * end.qy;
+  auto y = start.qw * end.qy + start.qx * end.qz - start.qy * end.qw -
+           start.qz * end.qx;
+  auto z = start.qw * end.qz - start.qx * end.qy + start.qy * end.qx -
+           start.qz * end.qw;
+  if (w < 0) {
+    w = -w;
+    x = -x;
+    y = -y;
+    z = -z;
+  }
+
+  // As angle about a unit axis
+  const auto sin_half = std::sqrt(x * x + y * y + z * z);
+  const auto angle = 2 * std::atan2(sin_half, w);
+  if (sin_half > 1e-12) {
+    x /= sin_half;
+    y /= sin_half;
+    z /= sin_half;
+  }
+
+  // Relative translation in the start frame, R(start)^T * (end - start)
+  float r0[9];
+  QuaternionToMatrix(start.qw, start.qx, start.qy, start.qz, r0);
+  const auto dx = end.x - start.x;
+  const auto dy = end.y - start.y;
+  const auto dz = end.z - start.z;
+  const auto tx = r0[0] * dx + r0[3] * dy + r0[6] * dz;
+  const auto ty = r0[1] * dx + r0[4] * dy + r0[7] * dz;
+  const auto tz = r0[2] * dx + r0[5] * dy + r0[8] * dz;
+
+  // Differences are signed and alpha is clamped to the two poses, in case
+  // the stamps do not grow monotonically
+  const auto t0 = timestamps[col_begin];
+  const auto duration =
+      static_cast<double>(static_cast<int64_t>(timestamps[col_end - 1] - t0));
+
+  for (int c = col_begin; c < col_end; ++c) {
+    const auto dt = static_cast<int64_t>(timestamps[c] - t0);
+    const auto alpha =
+        duration > 0 ? std::min(std::max(dt / duration, 0.0), 1.0) : 0.0;
+    const auto half = alpha * angle / 2;
+    const auto s = std::sin(half);
+
+    float r[9];
+    QuaternionToMatrix(std::cos(half), x * s, y * s, z * s, r);
+    for (int i = 0; i < 9; ++i) transforms.r[i][c] = r[i];
+    transforms.t[0][c] = alpha * tx;
+    transforms.t[1][c] = alpha * ty;
+    transforms.t[2][c] = alpha * tz;
+  }
+}
+
+/// Portable reference implementation of ApplyColumnTransforms, also used for
+/// the columns left over by the vector kernels
+static void ApplyColumnTransformsScalar(const ColumnTransforms& transforms,
+                                        int col_begin, int col_end, float* x,
+                                        float* y, float* z) {
+  const auto& r = transforms.r;
+  const auto& t = transforms.t;
+  for (int c = col_begin, i = 0; c < col_end; ++c, ++i) {
+    const auto px = x[i];
+    const auto py = y[i];
+    const auto pz = z[i];
+    x[i] = r[0][c] * px + r[1][c] * py + r[2][c] * pz + t[0][c];
+    y[i] = r[3][c] * px + r[4][c] * py + r[5][c] * pz + t[1][c];
+    z[i] = r[6][c] * px + r[7][c] * py + r[8][c] * pz + t[2][c];
+  }
+}
+
+#if defined(VELODYNE_PUCK_X86)
+/// Row r[0..2] of the rotations of columns [i, i + 8) times p plus
+/// translation t
+__attribute__((target("avx"))) static inline __m256 TransformRowAvx(
+    const float* const* r, const float* t, int i, __m256 px, __m256 py,
+    __m256 pz) {
+  const __m256 rx = _mm256_mul_ps(_mm256_loadu_ps(r[0] + i), px);
+  const __m256 ry = _mm256_mul_ps(_mm256_loadu_ps(r[1] + i), py);
+  const __m256 rz = _mm256_mul_ps(_mm256_loadu_ps(r[2] + i), pz);
+  return _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(rx, ry), rz),
+                       _mm256_loadu_ps(t + i));
+}
+
+/// 8 columns at a time. Multiply and add stay separate, so results match the
+/// scalar implementation exactly.
+__attribute__((target("avx"))) static void ApplyColumnTransformsAvx(
+    const ColumnTransforms& transforms, int col_begin, int col_end, float* x,
+    float* y, float* z) {
+  const float* r[9];
+  const float* t[3];
+  for (int k = 0; k < 9; ++k) r[k] = transforms.r[k].data() + col_begin;
+  for (int k = 0; k < 3; ++k) t[k] = transforms.t[k].data() + col_begin;
+
+  const int cols = col_end - col_begin;
+  int i = 0;
+  for (; i + 8 <= cols; i += 8) {
+    const __m256 px = _mm256_loadu_ps(x + i);
+    const __m256 py = _mm256_loadu_ps(y + i);
+    const __m256 pz = _mm256_loadu_ps(z + i);
+    _mm256_storeu_ps(x + i, TransformRowAvx(r, t[0], i, px, py, pz));
+    _mm256_storeu_ps(y + i, TransformRowAvx(r + 3, t[1], i, px, py, pz));
+    _mm256_storeu_ps(z + i, TransformRowAvx(r + 6, t[2], i, px, py, pz));
+  }
+  // The scalar tail is SSE code, avoid the penalty of mixing it with AVX
+  _mm256_zeroupper();
+  ApplyColumnTransformsScalar(transforms, col_begin + i, col_end, x + i, y + i,
+                              z + i);
+}
+#endif
+
+#if defined(VELODYNE_PUCK_NEON)
+/// Row r[0..2] of the rotations of columns [i, i + 4) times p plus
+/// translation t
+static inline float32x4_t TransformRowNeon(const float* const* r,
+                                           const float* t, int i,
+                                           float32x4_t px, float32x4_t py,
+                                           float32x4_t pz) {
+  const float32x4_t rx = vmulq_f32(vld1q_f32(r[0] + i), px);
+  const float32x4_t ry = vmulq_f32(vld1q_f32(r[1] + i), py);
+  const float32x4_t rz = vmulq_f32(vld1q_f32(r[2] + i), pz);
+  return vaddq_f32(vaddq_f32(vaddq_f32(rx, ry), rz), vld1q_f32(t + i));
+}
+
+/// 4 columns at a time, see ApplyColumnTransformsAvx
+static void ApplyColumnTransformsNeon(const ColumnTransforms& transforms,
+                                      int col_begin, int col_end, float* x,
+                                      float* y, float* z) {
+  const float* r[9];
+  const float* t[3];
+  for (int k = 0; k < 9; ++k) r[k] = transforms.r[k].data() + col_begin;
+  for (int k = 0; k < 3; ++k) t[k] = transforms.t[k].data() + col_begin;
+
+  const int cols = col_end - col_begin;
+  int i = 0;
+  for (; i + 4 <= cols; i += 4) {
+    const float32x4_t px = vld1q_f32(x + i);
+    const float32x4_t py = vld1q_f32(y + i);
+    const float32x4_t pz = vld1q_f32(z + i);
+    vst1q_f32(x + i, TransformRowNeon(r, t[0], i, px, py, pz));
+    vst1q_f32(y + i, TransformRowNeon(r + 3, t[1], i, px, py, pz));
+    vst1q_f32(z + i, TransformRowNeon(r + 6, t[2], i, px, py, pz));
+  }
+  ApplyColumnTransformsScalar(transforms, col_begin + i, col_end, x + i, y + i,
+                              z + i);
+}
+#endif
+
+using ApplyColumnTransformsFn = void (*)(const ColumnTransforms&, int, int,
+                                         float*, float*, float*);
+
+static ApplyColumnTransformsFn SelectApplyColumnTransforms() {
+#if defined(VELODYNE_PUCK_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) return ApplyColumnTransformsAvx;
+#elif defined(VELODYNE_PUCK_NEON)
+  // NEON is mandatory on aarch64
+  return ApplyColumnTransformsNeon;
+#endif
+  return ApplyColumnTransformsScalar;
+}
+
+void ApplyColumnTransforms(const ColumnTransforms& transforms, int col_begin,
+                           int col_end, float* x, float* y, float* z) {
+  static const auto fn = SelectApplyColumnTransforms();
+  fn(transforms, col_begin, col_end, x, y, z);
+}
+
+}  // namespace velodyne_puck
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace velodyne_puck {
+
+/// Pose of the sensor in a fixed frame, rotation as a unit quaternion
+struct Pose {
+  double qw{1}, qx{0}, qy{0}, qz{0};
+  double x{0}, y{0}, z{0};
+};
+
+/// Rigid transforms of the points of each column, row-major rotation r
+/// followed by translation t. Each element is a plane indexed by column, so
+/// that a row of points is transformed with vector instructions.
+struct ColumnTransforms {
+  std::vector<float> r[9];
+  std::vector<float> t[3];
+
+  size_t size() const { return t[0].size(); }
+  void resize(size_t cols) {
+    for (auto& plane : r) plane.resize(cols);
+    for (auto& plane : t) plane.resize(cols);
+  }
+};
+
+/// Transforms that move the points of each column c in [col_begin, col_end)
+/// from the sensor frame at timestamps[c] into the one at
+/// timestamps[col_begin]. Motion is constant velocity from start, the pose at
+/// timestamps[col_begin], to end, the pose at timestamps[col_end - 1], so
+/// only one sin/cos per column is needed. transforms grows to at least
+/// col_end columns.
+void InterpolateColumns(const Pose& start, const Pose& end,
+                        const uint64_t* timestamps, int col_begin, int col_end,
+                        ColumnTransforms& transforms);
+
+/// Transform the points (x[i], y[i], z[i]) of columns col_begin + i in
+/// [col_begin, col_end) in place, NaN points stay NaN. Uses the fastest
+/// implementation supported by this cpu, selected once at runtime.
+void ApplyColumnTransforms(const ColumnTransforms& transforms, int col_begin,
+                           int col_end, float* x, float* y, float* z);
+
+}  // namespace velodyne_puck
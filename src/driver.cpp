@@ -3,70 +3,66 @@
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cmath>
 
-#include "constants.h"
-
-#include <diagnostic_updater/diagnostic_updater.h>
-#include <diagnostic_updater/publisher.h>
-#include <velodyne_msgs/VelodynePacket.h>
-#include <velodyne_msgs/VelodyneScan.h>
+#include "driver.h"
+#include "packet.h"
 
 namespace velodyne_puck {
 
 using namespace velodyne_msgs;
 using namespace diagnostic_updater;
 
-/// Constants
-static constexpr uint16_t kUdpPort = 2368;
-static constexpr size_t kPacketSize = sizeof(VelodynePacket().data);
-static constexpr int kError = -1;
-
-// p49 8.2.1
-static constexpr double kDelayPerPacketNs =
-    kSequencesPerPacket * kFiringCycleNs;
-static constexpr double kPacketsPerSecond = 1e9 / kDelayPerPacketNs;
-
-class Driver {
- public:
-  explicit Driver(const ros::NodeHandle &pnh);
-  ~Driver();
-
-  bool Poll();
+/// Raw azimuth of the first data block, stored little-endian after the two
+/// flag bytes
+inline uint16_t FirstBlockAzimuth(const VelodynePacket &packet) {
+  return packet.data[2] | (packet.data[3] << 8);
+}
 
- private:
-  bool OpenUdpPort();
-  int ReadPacket(VelodynePacket &packet) const;
+/// Packet::stamp, micro seconds since the top of the hour, little-endian
+/// after the 12 data blocks
+inline uint32_t PacketStamp(const uint8_t *data) {
+  uint32_t stamp;
+  memcpy(&stamp, data + kBlocksPerPacket * 100, sizeof(stamp));
+  return stamp;
+}
 
-  // Ethernet relate variables
-  std::string device_ip_str_;
-  in_addr device_ip_;
-  int socket_id_{-1};
+inline uint32_t PacketStamp(const VelodynePacket &packet) {
+  return PacketStamp(&packet.data[0]);
+}
 
-  // ROS related variables
-  ros::NodeHandle pnh_;
-  ros::Publisher pub_packet_;
+/// Time from the first firing of a packet until the sensor sends it, one
+/// firing cycle per column, 1.327 ms for single returns (8.2.1)
+inline ros::Duration PacketDuration(const uint8_t *data) {
+  return ros::Duration().fromNSec(static_cast<int64_t>(
+      ColumnsPerPacket(data[kPacketSize - 2]) * kFiringCycleNs));
+}
 
-  // Diagnostics updater
-  diagnostic_updater::Updater updater_;
-  boost::shared_ptr<diagnostic_updater::TopicDiagnostic> topic_diag_;
-  std::vector<VelodynePacket> buffer_;
-  double freq_;
-};
+// Sensor time stamp is micro seconds since the top of the hour
+static constexpr int64_t kHourNs = 3600000000000ll;
+
+/// Absolute time of stamp [us since the top of the hour] in the hour closest
+/// to reference
+inline ros::Time SensorTime(uint32_t stamp, const ros::Time &reference) {
+  const auto reference_ns = static_cast<int64_t>(reference.toNSec());
+  auto ns = reference_ns - reference_ns % kHourNs + stamp * 1000ll;
+  if (ns - reference_ns > kHourNs / 2) {
+    ns -= kHourNs;
+  } else if (reference_ns - ns > kHourNs / 2) {
+    ns += kHourNs;
+  }
+  return ros::Time().fromNSec(ns);
+}
 
 Driver::Driver(const ros::NodeHandle &pnh) : pnh_(pnh) {
   ROS_INFO("packet size: %zu", kPacketSize);
-  pnh_.param("device_ip", device_ip_str_, std::string("192.168.1.201"));
-  ROS_INFO("device_ip: %s", device_ip_str_.c_str());
-
-  if (inet_aton(device_ip_str_.c_str(), &device_ip_) == 0) {
-    // inet_aton() returns nonzero if the address is valid, zero if not.
-    ROS_FATAL("Invalid device ip: %s", device_ip_str_.c_str());
-    ros::shutdown();
-  }
 
   // ROS diagnostics
   updater_.setHardwareID("VLP16");
@@ -80,35 +76,226 @@ Driver::Driver(const ros::NodeHandle &pnh) : pnh_(pnh) {
   // There are 24 firing cycles in a data packet.
   // 24 x 55.296 μs = 1.327 ms is the accumulation delay per packet.
   // 1 packet/1.327 ms = 753.5 packets/second
-  freq_ = kPacketsPerSecond;
-  ROS_INFO("expected frequency: %.3f (Hz)", freq_);
+  ROS_INFO("expected frequency: %.3f (Hz)", kPacketsPerSecond);
+
+  // Batched receive with recvmmsg(), 1 means one packet per call
+  pnh_.param("batch_size", batch_size_, 1);
+  batch_size_ = std::max(batch_size_, 1);
+  batch_msgs_.resize(batch_size_);
+  batch_iovecs_.resize(batch_size_);
+  if (batch_size_ > 1) {
+    updater_.add("batch", this, &Driver::BatchDiagnostic);
+  }
 
-  topic_diag_.reset(new TopicDiagnostic(
-      "packet", updater_, FrequencyStatusParam(&freq_, &freq_, 0.1, 100),
-      TimeStampStatusParam(-0.1, 0.1)));
+  // Packets waiting to be published, about a second by default
+  int ring_size;
+  pnh_.param("ring_size", ring_size, 1024);
+  ring_.reset(new SpscRing<Slot>(std::max(ring_size, batch_size_)));
+  ROS_INFO("batch_size: %d, ring_size: %zu", batch_size_, ring_->capacity());
+
+  // Packet stamps
+  std::string time_source;
+  pnh_.param<std::string>("time_source", time_source, "system");
+  pnh_.param("sensor_time_tolerance", sensor_time_tolerance_, 0.1);
+  if (time_source == "kernel") {
+    time_source_ = TimeSource::kKernel;
+  } else if (time_source == "sensor") {
+    time_source_ = TimeSource::kSensor;
+  } else if (time_source != "system") {
+    ROS_ERROR("Unknown time_source: %s, use system", time_source.c_str());
+    time_source = "system";
+  }
+  ROS_INFO("time_source: %s, sensor_time_tolerance: %f", time_source.c_str(),
+           sensor_time_tolerance_);
+  if (time_source_ != TimeSource::kSystem) {
+    updater_.add("time", this, &Driver::TimeDiagnostic);
+  }
 
-  // Output
-  pub_packet_ = pnh_.advertise<VelodynePacket>("packet", 10);
+  // Receive thread and socket, the kernel drops packets once rcvbuf is full
+  pnh_.param("rcvbuf", rcvbuf_, 0);
+  pnh_.param("cpu", cpu_, -1);
+  pnh_.param("priority", priority_, 0);
+  ROS_INFO("rcvbuf: %d (0 is default), cpu: %d (-1 is any), priority: %d",
+           rcvbuf_, cpu_, priority_);
+
+  // Scan mode
+  pnh_.param("publish_scan", publish_scan_, false);
+  pnh_.param("scan_packets", scan_packets_, 0);
+  scan_packets_ = std::max(scan_packets_, 0);
+  ROS_INFO("publish_scan: %s, scan_packets: %d (0 is one revolution)",
+           publish_scan_ ? "True" : "False", scan_packets_);
+
+  // Replay
+  std::string pcap;
+  pnh_.param("pcap", pcap, std::string());
+  pnh_.param("pcap_rate", pcap_rate_, 1.0);
+  pnh_.param("pcap_loop", pcap_loop_, false);
+  pnh_.param("pcap_clone", pcap_clone_, false);
+
+  if (!LoadSensors()) {
+    ros::shutdown();
+    return;
+  }
+
+  if (!pcap.empty()) {
+    ROS_INFO(
+        "pcap_rate: %f (0 is as fast as possible), pcap_loop: %s, "
+        "pcap_clone: %s",
+        pcap_rate_, pcap_loop_ ? "True" : "False",
+        pcap_clone_ ? "True" : "False");
+    pcap_.reset(new PcapReader(pcap));
+    if (!pcap_->ok()) ros::shutdown();
+    return;
+  }
 
-  if (!OpenUdpPort()) {
-    ROS_ERROR("Failed to open UDP Port");
+  epoll_fd_ = epoll_create1(0);
+  if (epoll_fd_ == -1) {
+    ROS_FATAL("Failed to create epoll: %s", strerror(errno));
+    ros::shutdown();
+    return;
   }
+  epoll_events_.resize(sockets_.size());
+
+  for (size_t i = 0; i < sockets_.size(); ++i) {
+    auto &socket = sockets_[i];
+    if (!OpenUdpPort(socket)) {
+      ROS_ERROR("Failed to open UDP Port %d", socket.port);
+      continue;
+    }
+
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, socket.fd, &event) == -1) {
+      ROS_ERROR("Failed to add socket %d to epoll: %s", socket.fd,
+                strerror(errno));
+      continue;
+    }
 
-  ROS_INFO("Successfully opened UDP Port at %s", device_ip_str_.c_str());
+    ROS_INFO("Successfully opened UDP Port %d for %zu sensor(s)", socket.port,
+             socket.sensors.size());
+  }
+  updater_.add("socket", this, &Driver::SocketDiagnostic);
+
+  ring_event_ = eventfd(0, 0);
+  if (ring_event_ == -1) {
+    ROS_FATAL("Failed to create eventfd: %s", strerror(errno));
+    ros::shutdown();
+    return;
+  }
+  packet_pool_.Reserve(ring_->capacity());
+  publish_thread_ = std::thread(&Driver::PublishLoop, this);
 }
 
 Driver::~Driver() {
-  if (close(socket_id_)) {
-    ROS_INFO("Close socket %d at %s", socket_id_, device_ip_str_.c_str());
+  if (publish_thread_.joinable()) {
+    stop_ = true;
+    const uint64_t one = 1;
+    if (write(ring_event_, &one, sizeof(one)) == -1) {
+      ROS_ERROR("Failed to wake up publish thread: %s", strerror(errno));
+    }
+    publish_thread_.join();
+  }
+  if (ring_event_ != -1) close(ring_event_);
+
+  for (const auto &socket : sockets_) {
+    if (socket.fd == -1) continue;
+    if (close(socket.fd) == 0) {
+      ROS_INFO("Close socket %d at port %d", socket.fd, socket.port);
+    } else {
+      ROS_ERROR("Failed to close socket %d at port %d", socket.fd,
+                socket.port);
+    }
+  }
+  if (epoll_fd_ != -1) close(epoll_fd_);
+}
+
+bool Driver::LoadSensors() {
+  std::vector<std::string> names;
+  if (!pnh_.getParam("sensors", names)) {
+    // Single sensor, topics directly in the private namespace
+    Sensor sensor;
+    pnh_.param("device_ip", sensor.device_ip_str,
+               std::string("192.168.1.201"));
+    pnh_.param("port", sensor.port, static_cast<int>(kUdpPort));
+    pnh_.param<std::string>("frame_id", sensor.frame_id, "velodyne");
+    return AddSensor(std::move(sensor));
+  }
+
+  if (names.empty()) {
+    ROS_FATAL("Empty sensor list");
+    return false;
+  }
+
+  // Each sensor has its parameters in ~<name>/
+  for (const auto &name : names) {
+    const ros::NodeHandle nh(pnh_, name);
+    Sensor sensor;
+    sensor.name = name;
+    nh.param("device_ip", sensor.device_ip_str, std::string());
+    nh.param("port", sensor.port, static_cast<int>(kUdpPort));
+    nh.param("frame_id", sensor.frame_id, name);
+    if (!AddSensor(std::move(sensor))) return false;
+  }
+
+  return true;
+}
+
+bool Driver::AddSensor(Sensor sensor) {
+  const auto label =
+      sensor.name.empty() ? std::string("velodyne") : sensor.name;
+  ROS_INFO("sensor: %s, device_ip: %s, port: %d, frame_id: %s", label.c_str(),
+           sensor.device_ip_str.c_str(), sensor.port, sensor.frame_id.c_str());
+
+  // inet_aton() returns nonzero if the address is valid, zero if not.
+  if (!sensor.device_ip_str.empty() &&
+      inet_aton(sensor.device_ip_str.c_str(), &sensor.device_ip) == 0) {
+    ROS_FATAL("Invalid device ip: %s", sensor.device_ip_str.c_str());
+    return false;
+  }
+
+  ros::NodeHandle nh(pnh_, sensor.name);
+  const auto prefix = sensor.name.empty() ? std::string() : sensor.name + "/";
+  // Output
+  if (publish_scan_) {
+    sensor.scan.reset(new VelodyneScan);
+    sensor.scan->header.frame_id = sensor.frame_id;
+    sensor.pub_scan = nh.advertise<VelodyneScan>("scan", 10);
   } else {
-    ROS_ERROR("Failed to close socket %d at %s", socket_id_,
-              device_ip_str_.c_str());
+    sensor.pub_packet = nh.advertise<VelodynePacket>("packet", 10);
   }
+  sensor.pacer = ReplayPacer(pcap_rate_);
+
+  sensors_.emplace_back(new Sensor(std::move(sensor)));
+  auto *added = sensors_.back().get();
+
+  // Expected rate of this sensor only, now that it stays where it is
+  added->topic_diag.reset(new TopicDiagnostic(
+      prefix + "packet", updater_,
+      FrequencyStatusParam(&added->freq, &added->freq, 0.1, 100),
+      TimeStampStatusParam(-0.1, 0.1)));
+
+  // Sensors on the same port share one socket
+  auto it = std::find_if(
+      sockets_.begin(), sockets_.end(),
+      [added](const Socket &socket) { return socket.port == added->port; });
+  if (it == sockets_.end()) {
+    sockets_.emplace_back();
+    sockets_.back().port = added->port;
+    it = sockets_.end() - 1;
+  }
+  it->sensors.push_back(added);
+
+  ROS_WARN_COND(
+      it->sensors.size() > 1 && added->device_ip_str.empty() && !pcap_clone_,
+      "Sensors on port %d need a device_ip each", added->port);
+  return true;
 }
 
-bool Driver::OpenUdpPort() {
-  socket_id_ = socket(PF_INET, SOCK_DGRAM, 0);
-  if (socket_id_ == -1) {
+bool Driver::OpenUdpPort(Socket &socket) {
+  socket.fd = ::socket(PF_INET, SOCK_DGRAM, 0);
+  if (socket.fd == -1) {
     perror("socket");
     ROS_ERROR("Failed to create socket");
     return false;
@@ -117,149 +304,514 @@ bool Driver::OpenUdpPort() {
   sockaddr_in my_addr;                   // my address information
   memset(&my_addr, 0, sizeof(my_addr));  // initialize to zeros
   my_addr.sin_family = AF_INET;          // host byte order
-  my_addr.sin_port = htons(kUdpPort);    // short, in network byte order
+  my_addr.sin_port = htons(socket.port);  // short, in network byte order
   my_addr.sin_addr.s_addr = INADDR_ANY;  // automatically fill in my IP
 
-  if (bind(socket_id_, (sockaddr *)&my_addr, sizeof(sockaddr)) == -1) {
+  if (bind(socket.fd, (sockaddr *)&my_addr, sizeof(sockaddr)) == -1) {
     perror("bind");  // TODO: ROS_ERROR errno
-    ROS_ERROR("Failed to bind to socket %d", socket_id_);
+    ROS_ERROR("Failed to bind to socket %d", socket.fd);
     return false;
   }
 
-  if (fcntl(socket_id_, F_SETFL, O_NONBLOCK | FASYNC) < 0) {
+  if (fcntl(socket.fd, F_SETFL, O_NONBLOCK | FASYNC) < 0) {
     perror("non-block");
     ROS_ERROR("Failed to set socket to non-blocking");
     return false;
   }
 
+  // Room for bursts while the receive thread is not scheduled. FORCE ignores
+  // net.core.rmem_max but needs CAP_NET_ADMIN.
+  if (rcvbuf_ > 0 &&
+      setsockopt(socket.fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf_,
+                 sizeof(rcvbuf_)) == -1 &&
+      setsockopt(socket.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_,
+                 sizeof(rcvbuf_)) == -1) {
+    ROS_WARN("Failed to set SO_RCVBUF: %s", strerror(errno));
+  }
+  socklen_t len = sizeof(socket.rcvbuf);
+  getsockopt(socket.fd, SOL_SOCKET, SO_RCVBUF, &socket.rcvbuf, &len);
+  // The kernel doubles what was asked for, less means it was capped
+  ROS_WARN_COND(rcvbuf_ > 0 && socket.rcvbuf < 2 * int64_t{rcvbuf_},
+                "SO_RCVBUF of port %d is %d bytes for %d asked for, capped by "
+                "net.core.rmem_max",
+                socket.port, socket.rcvbuf, rcvbuf_);
+
+  // Drops because the buffer was full come with the next datagram
+  const int enable = 1;
+  if (setsockopt(socket.fd, SOL_SOCKET, SO_RXQ_OVFL, &enable,
+                 sizeof(enable)) == -1) {
+    ROS_WARN("Failed to enable SO_RXQ_OVFL: %s", strerror(errno));
+  }
+
+  // Kernel stamps every datagram on arrival, sensor time is checked against
+  // that too
+  if (time_source_ != TimeSource::kSystem &&
+      setsockopt(socket.fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable,
+                 sizeof(enable)) == -1) {
+    ROS_WARN("Failed to enable SO_TIMESTAMPNS: %s, use system time",
+             strerror(errno));
+  }
+
   return true;
 }
 
-int Driver::ReadPacket(VelodynePacket &packet) const {
-  const auto time_before = ros::Time::now();
-
-  struct pollfd fds[1];
-  fds[0].fd = socket_id_;
-  fds[0].events = POLLIN;
+int Driver::WaitForSockets(std::vector<Socket *> &ready) {
   const int timeout_ms = 1000;  // one second (in msec)
 
-  sockaddr_in sender_address;
-  socklen_t sender_address_len = sizeof(sender_address);
-
-  while (true) {
-    // Unfortunately, the Linux kernel recvfrom() implementation
-    // uses a non-interruptible sleep() when waiting for data,
-    // which would cause this method to hang if the device is not
-    // providing data.  We poll() the device first to make sure
-    // the recvfrom() will not block.
-    //
-    // Note, however, that there is a known Linux kernel bug:
-    //
-    //   Under Linux, select() may report a socket file descriptor
-    //   as "ready for reading", while nevertheless a subsequent
-    //   read blocks.  This could for example happen when data has
-    //   arrived but upon examination has wrong checksum and is
-    //   discarded.  There may be other circumstances in which a
-    //   file descriptor is spuriously reported as ready.  Thus it
-    //   may be safer to use O_NONBLOCK on sockets that should not
-    //   block.
-
-    // poll() until input available
-    do {
-      const int retval = poll(fds, 1, timeout_ms);
-
-      if (retval < 0) {
-        // poll() error?
-        if (errno != EINTR) ROS_ERROR("poll() error: %s", strerror(errno));
-        return kError;
-      } else if (retval == 0) {
-        // poll() timeout?
-        ROS_WARN("Velodyne poll() timeout");
-        return kError;
-      }
+  // Unfortunately, the Linux kernel recvfrom() implementation
+  // uses a non-interruptible sleep() when waiting for data,
+  // which would cause this method to hang if the device is not
+  // providing data.  We epoll() the sockets first to make sure
+  // the recvfrom() will not block.
+  //
+  // Sockets are also O_NONBLOCK, a socket may be spuriously reported
+  // as ready for reading, e.g. when data has arrived but upon
+  // examination has wrong checksum and is discarded.
+
+  // epoll() until input available on any socket
+  do {
+    const int n = epoll_wait(epoll_fd_, epoll_events_.data(),
+                             epoll_events_.size(), timeout_ms);
+
+    if (n < 0) {
+      // epoll() error?
+      if (errno != EINTR) ROS_ERROR("epoll() error: %s", strerror(errno));
+      return kError;
+    } else if (n == 0) {
+      // epoll() timeout?
+      ROS_WARN("Velodyne poll() timeout");
+      return kError;
+    }
 
-      if ((fds[0].revents & POLLERR) || (fds[0].revents & POLLHUP) ||
-          (fds[0].revents & POLLNVAL)) {
+    for (int i = 0; i < n; ++i) {
+      const auto events = epoll_events_[i].events;
+      if (events & (EPOLLERR | EPOLLHUP)) {
         // device error?
-        ROS_ERROR("poll() reports Velodyne error");
+        ROS_ERROR("epoll() reports Velodyne error");
         return kError;
       }
-    } while ((fds[0].revents & POLLIN) == 0);
-
-    // Receive packets that should now be available from the
-    // socket using a blocking read.
-    const ssize_t nbytes =
-        recvfrom(socket_id_, &packet.data[0], kPacketSize, 0,
-                 (sockaddr *)&sender_address, &sender_address_len);
-
-    if (nbytes < 0) {
-      if (errno != EWOULDBLOCK) {
-        perror("recvfail");
-        ROS_ERROR("Failed to read from socket");
-        return kError;
+      if (events & EPOLLIN) {
+        ready.push_back(&sockets_[epoll_events_[i].data.u32]);
       }
-    } else if ((size_t)nbytes == kPacketSize) {
-      // read successful,
-      // if packet is not from the lidar scanner we selected by IP,
-      // continue otherwise we are done
-      if (device_ip_str_ != "" &&
-          sender_address.sin_addr.s_addr != device_ip_.s_addr)
-        continue;
-      else
-        break;  // done
     }
+  } while (ready.empty());
+
+  return ready.size();
+}
+
+Driver::Sensor *Driver::FindSensor(const Socket &socket,
+                                   const sockaddr_in &sender) const {
+  for (auto *sensor : socket.sensors) {
+    if (sensor->device_ip_str.empty() ||
+        sender.sin_addr.s_addr == sensor->device_ip.s_addr) {
+      return sensor;
+    }
+  }
+  return nullptr;
+}
+
+void Driver::UpdateDrops(Socket &socket, msghdr &hdr) {
+  // Only sent once something was dropped
+  for (auto *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(&socket.drops, CMSG_DATA(cmsg), sizeof(socket.drops));
+    }
+  }
+}
+
+ros::Time Driver::PacketTime(const VelodynePacket &packet, msghdr &hdr) {
+  // Every packet is sent right after its last firing
+  const auto accumulation = PacketDuration(&packet.data[0]);
+  if (time_source_ == TimeSource::kSystem) {
+    return ros::Time::now() - accumulation;
+  }
+
+  ++time_stats_.packets;
+
+  ros::Time received;
+  for (auto *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      received = ros::Time(ts.tv_sec, ts.tv_nsec);
+    }
+  }
+  if (received.isZero()) {
+    ++time_stats_.fallbacks;
+    ROS_WARN_THROTTLE(1, "No kernel receive time, use system time");
+    return ros::Time::now() - accumulation;
+  }
+
+  if (time_source_ == TimeSource::kKernel) return received - accumulation;
+
+  const auto sensor_time = SensorTime(PacketStamp(packet), received);
+  const auto offset = (received - sensor_time).toSec();
+  time_stats_.sum_offset += offset;
+  time_stats_.max_offset = std::max(time_stats_.max_offset, std::abs(offset));
+  if (std::abs(offset) > sensor_time_tolerance_) {
+    ++time_stats_.fallbacks;
+    ROS_WARN_THROTTLE(1, "Sensor time is off by %f s, is PPS locked?", offset);
+    return received - accumulation;
+  }
+  return sensor_time;
+}
+
+int Driver::ReadPackets(Socket &socket) {
+  // Straight into the free slots of the ring, or into overflow_ which is
+  // dropped if there are none
+  Slot *slots;
+  auto num_slots = ring_->BeginWrite(slots, batch_size_);
+  const bool overflow = num_slots == 0;
+  if (overflow) {
+    slots = &overflow_;
+    num_slots = 1;
+  }
+
+  for (size_t i = 0; i < num_slots; ++i) {
+    batch_iovecs_[i].iov_base = slots[i].data;
+    batch_iovecs_[i].iov_len = kPacketSize;
+
+    auto &hdr = batch_msgs_[i].msg_hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &batch_iovecs_[i];
+    hdr.msg_iovlen = 1;
+    hdr.msg_name = &slots[i].sender;
+    hdr.msg_namelen = sizeof(sockaddr_in);
+    hdr.msg_control = slots[i].control;
+    hdr.msg_controllen = kControlSize;
+    batch_msgs_[i].msg_len = 0;
+  }
 
-    ROS_DEBUG_STREAM("incomplete Velodyne packet read: " << nbytes << " bytes");
+  // Drain whatever is queued without blocking, epoll() told us there is at
+  // least one datagram
+  const int n =
+      recvmmsg(socket.fd, batch_msgs_.data(), num_slots, MSG_DONTWAIT, nullptr);
+  if (n < 0) {
+    if (errno == EWOULDBLOCK || errno == EINTR) return 0;
+    perror("recvfail");
+    ROS_ERROR("Failed to read from socket");
+    return kError;
   }
 
-  // Average the times at which we begin and end reading.  Use that to
-  // estimate when the scan occurred.
-  //  const auto time_after = ros::Time::now();
-  // Usually take around 0.0012s on my pc
-  //  ROS_INFO("time: %f", time_after - time_before);
-  //  packet.stamp = ros::Time((time_after + time_before) / 2.0);
-  // The ros velodyne driver uses average time to as the time of the packet.
-  // We just use the starting time, and the actual time is this time + some time
-  // delay of communication
-  packet.stamp = time_before;
+  // Packets are queued back to back, so the earlier ones in the batch
+  // arrived one packet duration apart before the last one
+  auto received = ros::Time::now();
 
-  return 0;
+  batch_stats_.batches.fetch_add(1, std::memory_order_relaxed);
+  batch_stats_.packets.fetch_add(n, std::memory_order_relaxed);
+  batch_stats_.last.store(n, std::memory_order_relaxed);
+  auto max = batch_stats_.max.load(std::memory_order_relaxed);
+  while (n > max && !batch_stats_.max.compare_exchange_weak(
+                        max, n, std::memory_order_relaxed)) {
+  }
+
+  if (overflow) {
+    ring_drops_.fetch_add(n, std::memory_order_relaxed);
+    return n;
+  }
+
+  for (int i = n - 1; i >= 0; --i) {
+    auto &slot = slots[i];
+    slot.size = batch_msgs_[i].msg_len;
+    slot.control_size = batch_msgs_[i].msg_hdr.msg_controllen;
+    slot.socket = &socket;
+    // Stamped with the first firing like the other time sources, one packet
+    // duration before it was received, which is when the one before it was
+    received = received - PacketDuration(slot.data);
+    slot.stamp = received;
+  }
+  ring_->EndWrite(n);
+
+  // Wake up the publish thread, the counter adds up until it reads it
+  const uint64_t one = 1;
+  if (write(ring_event_, &one, sizeof(one)) == -1) {
+    ROS_ERROR("Failed to wake up publish thread: %s", strerror(errno));
+    return kError;
+  }
+  return n;
 }
 
-bool Driver::Poll() {
-  VelodynePacket::Ptr packet(new VelodynePacket);
+void Driver::PublishLoop() {
+  pollfd event;
+  event.fd = ring_event_;
+  event.events = POLLIN;
+  const int timeout_ms = 100;  // diagnostics also go out without packets
+
+  while (!stop_) {
+    if (poll(&event, 1, timeout_ms) > 0) {
+      uint64_t count;
+      if (read(ring_event_, &count, sizeof(count)) == -1 && errno != EINTR) {
+        ROS_ERROR("Failed to read eventfd: %s", strerror(errno));
+      }
+    }
 
-  while (true) {
-    // keep reading until full packet received
-    const int rc = ReadPacket(*packet);
-    if (rc == 0) break;        // got a full packet?
-    if (rc < 0) return false;  // end of file reached?
+    // Everything written so far, in runs of contiguous slots
+    Slot *slots;
+    while (const auto n = ring_->BeginRead(slots, ring_->capacity())) {
+      for (size_t i = 0; i < n; ++i) PublishSlot(slots[i]);
+      ring_->EndRead(n);
+    }
+    updater_.update();
+  }
+}
+
+void Driver::PublishSlot(Slot &slot) {
+  // Control messages as they came with the datagram
+  msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_control = slot.control;
+  hdr.msg_controllen = slot.control_size;
+  UpdateDrops(*slot.socket, hdr);
+
+  if (slot.size != kPacketSize) {
+    ROS_DEBUG_STREAM("incomplete Velodyne packet read: " << slot.size
+                                                         << " bytes");
+    return;
   }
 
+  // if packet is not from a lidar scanner we selected by IP, skip
+  auto *sensor = FindSensor(*slot.socket, slot.sender);
+  if (sensor == nullptr) return;
+
+  // Messages go back to the pool once subscribers release them
+  const VelodynePacket::Ptr packet = packet_pool_.Get();
+  memcpy(&packet->data[0], slot.data, kPacketSize);
+  packet->stamp = time_source_ == TimeSource::kSystem
+                      ? slot.stamp
+                      : PacketTime(*packet, hdr);
+  Publish(*sensor, packet);
+}
+
+void Driver::Publish(Sensor &sensor, const VelodynePacketConstPtr &packet) {
+  // Dual return packets cover half as many firings, so they come twice as
+  // often
+  const auto return_mode = packet->data[kPacketSize - 2];
+  sensor.freq = kPacketsPerSecond * BlocksPerColumn(return_mode);
+
   // publish message using time of last packet read
-  pub_packet_.publish(packet);
+  if (publish_scan_) {
+    AddToScan(sensor, *packet);
+  } else {
+    sensor.pub_packet.publish(packet);
+  }
 
   // notify diagnostics that a message has been published, updating
   // its status
-  topic_diag_->tick(packet->stamp);
-  updater_.update();
+  sensor.topic_diag->tick(packet->stamp);
+}
 
-  return true;
+void Driver::AddToScan(Sensor &sensor, const VelodynePacket &packet) {
+  const auto azimuth = FirstBlockAzimuth(packet);
+  auto &scan = sensor.scan;
+
+  // A new revolution starts when azimuth wraps around from 35999 to 0
+  const bool full =
+      !scan->packets.empty() &&
+      (scan_packets_ > 0
+           ? static_cast<int>(scan->packets.size()) >= scan_packets_
+           : azimuth < sensor.prev_azimuth);
+  sensor.prev_azimuth = azimuth;
+
+  if (full) PublishScan(sensor);
+
+  if (scan->packets.empty()) scan->header.stamp = packet.stamp;
+  scan->packets.push_back(packet);
 }
 
-}  // namespace velodyne_puck
+void Driver::PublishScan(Sensor &sensor) {
+  const auto num_packets = sensor.scan->packets.size();
+  sensor.pub_scan.publish(sensor.scan);
+
+  // The published scan is owned by subscribers now, start a new one sized
+  // like the last
+  sensor.scan.reset(new VelodyneScan);
+  sensor.scan->header.frame_id = sensor.frame_id;
+  sensor.scan->packets.reserve(num_packets);
+}
+
+void Driver::BatchDiagnostic(DiagnosticStatusWrapper &stat) {
+  // Counters are per diagnostic period, a batch racing with this ends up in
+  // either one
+  auto &bs = batch_stats_;
+  const auto batches = bs.batches.exchange(0, std::memory_order_relaxed);
+  const auto packets = bs.packets.exchange(0, std::memory_order_relaxed);
+  const auto max = bs.max.exchange(0, std::memory_order_relaxed);
+  const auto last = bs.last.load(std::memory_order_relaxed);
+  const double mean =
+      batches > 0 ? static_cast<double>(packets) / batches : 0.0;
+
+  // Batches that come back full mean the socket had more queued than we
+  // drained, the kernel buffer is at risk of overflowing
+  if (max >= batch_size_) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                 "Batch full, receive is falling behind");
+  } else {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "Batch size ok");
+  }
 
-int main(int argc, char **argv) {
-  ros::init(argc, argv, "velodyne_puck_driver");
-  ros::NodeHandle pnh("~");
+  stat.add("Batch size", batch_size_);
+  stat.add("Batches", batches);
+  stat.add("Packets", packets);
+  stat.add("Mean packets per batch", mean);
+  stat.add("Max packets per batch", max);
+  stat.add("Last packets per batch", last);
+}
+
+void Driver::TimeDiagnostic(DiagnosticStatusWrapper &stat) {
+  const auto &ts = time_stats_;
+  if (ts.fallbacks > 0) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                 time_source_ == TimeSource::kSensor
+                     ? "Sensor time not usable, check PPS"
+                     : "No kernel receive time");
+  } else {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "Time ok");
+  }
+
+  stat.add("Packets", ts.packets);
+  stat.add("Fallbacks to receive time", ts.fallbacks);
+  if (time_source_ == TimeSource::kSensor) {
+    stat.add("Mean receive - sensor time [s]",
+             ts.packets > 0 ? ts.sum_offset / ts.packets : 0.0);
+    stat.add("Max receive - sensor time [s]", ts.max_offset);
+  }
 
-  velodyne_puck::Driver node(pnh);
+  // Counters are per diagnostic period
+  time_stats_ = TimeStats{};
+}
+
+void Driver::SocketDiagnostic(DiagnosticStatusWrapper &stat) {
+  // Counters are cumulative per socket
+  uint32_t drops = 0;
+  for (auto &socket : sockets_) {
+    drops += socket.drops - socket.prev_drops;
+    socket.prev_drops = socket.drops;
+  }
+
+  const auto ring_drops = ring_drops_.exchange(0, std::memory_order_relaxed);
+
+  if (drops > 0) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                 "Kernel dropped packets, raise rcvbuf or priority");
+  } else if (ring_drops > 0) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                 "Ring full, publishing falls behind, raise ring_size");
+  } else if ((cpu_ >= 0 && !pinned_) || (priority_ > 0 && !realtime_)) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                 "Receive thread not pinned or not real time");
+  } else {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "Socket ok");
+  }
+
+  stat.add("Kernel drops", drops);
+  stat.add("Ring drops", ring_drops);
+  stat.add("Ring size", ring_->capacity());
+  for (const auto &socket : sockets_) {
+    const auto prefix = "Port " + std::to_string(socket.port);
+    stat.add(prefix + " rcvbuf [bytes]", socket.rcvbuf);
+    stat.add(prefix + " kernel drops total", socket.drops);
+  }
+  stat.add("Receive cpu", pinned_ ? std::to_string(cpu_) : "any");
+  stat.add("Receive priority",
+           realtime_ ? "SCHED_FIFO " + std::to_string(priority_) : "normal");
+}
+
+void Driver::SetupThread() {
+  if (cpu_ >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu_, &cpus);
+    const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    pinned_ = rc == 0;
+    if (pinned_) {
+      ROS_INFO("Receive thread pinned to cpu %d", cpu_);
+    } else {
+      ROS_WARN("Failed to pin receive thread to cpu %d: %s", cpu_,
+               strerror(rc));
+    }
+  }
+
+  if (priority_ > 0) {
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority_;
+    const int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    realtime_ = rc == 0;
+    if (realtime_) {
+      ROS_INFO("Receive thread at SCHED_FIFO priority %d", priority_);
+    } else {
+      // Usually EPERM, needs CAP_SYS_NICE or an rtprio limit
+      ROS_WARN("Failed to set SCHED_FIFO priority %d: %s", priority_,
+               strerror(rc));
+    }
+  }
+}
 
-  while (ros::ok()) {
-    // poll device until end of file
-    if (!node.Poll()) {
-      ROS_WARN("Stop due to error in Poll()");
-      break;
+bool Driver::PollPcap() {
+  PcapReader::Datagram datagram;
+  if (!pcap_->Next(datagram)) {
+    if (!pcap_loop_) {
+      ROS_INFO("End of pcap file");
+      return false;
     }
+
+    ROS_INFO("Restart pcap file");
+    pcap_->Rewind();
+    for (auto &sensor : sensors_) sensor->pacer.Reset();
+    return true;
+  }
+
+  if (datagram.size != kPacketSize) return true;
+
+  // Simulated sensors all replay the packet, paced by the first one
+  Sensor *sensor = pcap_clone_ ? sensors_.front().get() : nullptr;
+  if (!pcap_clone_) {
+    const auto socket = std::find_if(
+        sockets_.begin(), sockets_.end(), [&datagram](const Socket &socket) {
+          return socket.port == datagram.dst_port;
+        });
+    if (socket == sockets_.end()) return true;
+
+    sockaddr_in sender;
+    memset(&sender, 0, sizeof(sender));
+    sender.sin_addr = datagram.src_ip;
+    sensor = FindSensor(*socket, sender);
+    if (sensor == nullptr) return true;
   }
+
+  sensor->pacer.Wait(PacketStamp(datagram.payload));
+  const auto stamp = ros::Time::now() - PacketDuration(datagram.payload);
+
+  for (auto &other : sensors_) {
+    if (!pcap_clone_ && other.get() != sensor) continue;
+
+    // The mapped file is read only, so this is the only copy. Stamped at
+    // publish time like a live packet.
+    const VelodynePacket::Ptr packet = packet_pool_.Get();
+    memcpy(&packet->data[0], datagram.payload, kPacketSize);
+    packet->stamp = stamp;
+    Publish(*other, packet);
+  }
+  updater_.update();
+
+  return true;
 }
+
+bool Driver::Poll() {
+  if (pcap_) return PollPcap();
+
+  ready_.clear();
+  if (WaitForSockets(ready_) < 0) return false;
+
+  // Level triggered, a socket with more queued is reported again right away.
+  // Publishing and diagnostics are up to the publish thread.
+  for (auto *socket : ready_) {
+    if (ReadPackets(*socket) < 0) return false;
+  }
+
+  return true;
+}
+
+}  // namespace velodyne_puck
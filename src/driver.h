@@ -0,0 +1,228 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "constants.h"
+#include "pcap.h"
+#include "pool.h"
+#include "spsc_ring.h"
+
+#include <diagnostic_updater/diagnostic_updater.h>
+#include <diagnostic_updater/publisher.h>
+#include <ros/ros.h>
+#include <velodyne_msgs/VelodynePacket.h>
+#include <velodyne_msgs/VelodyneScan.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+namespace velodyne_puck {
+
+/// Constants
+static constexpr uint16_t kUdpPort = 2368;
+static constexpr size_t kPacketSize =
+    sizeof(velodyne_msgs::VelodynePacket().data);
+static constexpr int kError = -1;
+
+// Control message buffer per datagram, fits the receive time and the drop
+// counter
+static constexpr size_t kControlSize =
+    CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(uint32_t));
+
+/// Where packet stamps come from, each is the time of the first firing of the
+/// packet
+enum class TimeSource {
+  kSystem,  // ros::Time::now() right after the packet was read, minus the
+            // time the sensor took to fill it
+  kKernel,  // SO_TIMESTAMPNS receive time of each datagram, likewise
+  kSensor,  // top of the hour from the receive time plus Packet::stamp, needs
+            // the sensor synced to GPS/PPS
+};
+
+/// Receives packets of one or more sensors from a single epoll loop, or
+/// replays them from a pcap file. Each sensor has its own topics and
+/// diagnostics, sensors sharing a port share a socket and are told apart by
+/// sender ip. Live packets are received by the thread calling Poll() into a
+/// lock free ring, and published with diagnostics by a thread of the driver,
+/// so receiving never waits for ROS.
+class Driver {
+ public:
+  explicit Driver(const ros::NodeHandle &pnh);
+  ~Driver();
+
+  Driver(const Driver &) = delete;
+  Driver operator=(const Driver &) = delete;
+
+  /// Receives what is queued, or replays the next packet from pcap. False
+  /// on errors or at the end of the file.
+  bool Poll();
+
+  /// Pins the calling thread, the one that calls Poll(), to ~cpu and raises
+  /// it to SCHED_FIFO ~priority, if set. Failures are only warned about.
+  void SetupThread();
+
+ private:
+  /// One sensor, topics are advertised in namespace name (empty for a single
+  /// sensor), an empty device ip accepts packets from anyone
+  struct Sensor {
+    std::string name;
+    std::string device_ip_str;
+    in_addr device_ip;
+    int port{kUdpPort};
+    std::string frame_id;
+
+    ros::Publisher pub_packet;
+    ros::Publisher pub_scan;
+    boost::shared_ptr<diagnostic_updater::TopicDiagnostic> topic_diag;
+    // [Hz] expected packet rate in the return mode of the last packet
+    double freq{kPacketsPerSecond};
+
+    // Scan being assembled, only used if publish_scan_
+    velodyne_msgs::VelodyneScan::Ptr scan;
+    uint16_t prev_azimuth{0};
+
+    // Replay only, each sensor runs on its own clock
+    ReplayPacer pacer;
+  };
+
+  /// One bound socket per distinct port, shared by all sensors on that port
+  struct Socket {
+    int fd{-1};
+    int port{kUdpPort};
+    std::vector<Sensor *> sensors;
+
+    int rcvbuf{0};          // [bytes] as reported by the kernel
+    uint32_t drops{0};      // SO_RXQ_OVFL, dropped by the kernel so far
+    uint32_t prev_drops{0};  // at the last diagnostic update
+  };
+
+  /// Sensors from the ~sensors list, or a single one from ~device_ip
+  bool LoadSensors();
+  bool AddSensor(Sensor sensor);
+  bool OpenUdpPort(Socket &socket);
+
+  /// Sockets ready to read, waits at most one second
+  int WaitForSockets(std::vector<Socket *> &ready);
+
+  /// Sensor that sent a packet from sender, nullptr if none of socket
+  Sensor *FindSensor(const Socket &socket, const sockaddr_in &sender) const;
+
+  /// One received datagram, as it came from recvmmsg(), stamped later
+  struct Slot {
+    uint8_t data[kPacketSize];
+    uint32_t size{0};
+    sockaddr_in sender;
+    char control[kControlSize];
+    size_t control_size{0};
+    Socket *socket{nullptr};
+    ros::Time stamp;  // system time stamp of the first firing, estimated
+  };
+
+  /// Drains up to batch_size_ queued datagrams of socket into the ring with
+  /// one recvmmsg() call, returns how many or kError. If the ring is full
+  /// they are read and dropped.
+  int ReadPackets(Socket &socket);
+
+  /// Stamps and publishes what is in the ring, and updates diagnostics
+  void PublishLoop();
+  void PublishSlot(Slot &slot);
+
+  /// Kernel drop counter of socket from the control messages of hdr
+  void UpdateDrops(Socket &socket, msghdr &hdr);
+
+  /// Stamp of packet received with hdr according to time_source_, the time
+  /// of its first firing
+  ros::Time PacketTime(const velodyne_msgs::VelodynePacket &packet,
+                       msghdr &hdr);
+
+  /// Replays the next packet of pcap_, false at the end of the file unless
+  /// looping
+  bool PollPcap();
+
+  void Publish(Sensor &sensor,
+               const velodyne_msgs::VelodynePacketConstPtr &packet);
+
+  /// Appends packet to the scan being assembled, publishes the scan first if
+  /// this packet starts a new one
+  void AddToScan(Sensor &sensor, const velodyne_msgs::VelodynePacket &packet);
+  void PublishScan(Sensor &sensor);
+  void BatchDiagnostic(diagnostic_updater::DiagnosticStatusWrapper &stat);
+  void TimeDiagnostic(diagnostic_updater::DiagnosticStatusWrapper &stat);
+  void SocketDiagnostic(diagnostic_updater::DiagnosticStatusWrapper &stat);
+
+  // Ethernet relate variables
+  std::vector<std::unique_ptr<Sensor>> sensors_;
+  std::vector<Socket> sockets_;
+  int epoll_fd_{-1};
+  std::vector<epoll_event> epoll_events_;
+  std::vector<Socket *> ready_;
+
+  // Replay instead of receive if a pcap file is given, sockets_ are then
+  // only used to match ports
+  std::unique_ptr<PcapReader> pcap_;
+  double pcap_rate_{1.0};
+  bool pcap_loop_{false};
+  bool pcap_clone_{false};  // every sensor replays every packet
+
+  // Batched receive into the ring, shared by all sockets
+  int batch_size_{1};
+  std::vector<mmsghdr> batch_msgs_;
+  std::vector<iovec> batch_iovecs_;
+
+  // Receive thread (producer) to publish thread (consumer). The producer
+  // wakes the consumer through ring_event_, an eventfd. Datagrams that find
+  // the ring full go to overflow_.
+  std::unique_ptr<SpscRing<Slot>> ring_;
+  int ring_event_{-1};
+  Slot overflow_;
+  std::atomic<size_t> ring_drops_{0};
+  std::atomic_bool stop_{false};
+  std::thread publish_thread_;
+  Pool<velodyne_msgs::VelodynePacket> packet_pool_;
+
+  /// Number of packets drained per recvmmsg() since last diagnostic update,
+  /// written by the receive thread and drained by the diagnostics
+  struct BatchStats {
+    std::atomic<size_t> batches{0};
+    std::atomic<size_t> packets{0};
+    std::atomic<int> last{0};
+    std::atomic<int> max{0};
+  } batch_stats_;
+
+  // Packet stamps, sensor time further than sensor_time_tolerance_ [s] from
+  // the receive time is not trusted
+  TimeSource time_source_{TimeSource::kSystem};
+  double sensor_time_tolerance_{0.1};
+
+  /// Per diagnostic period
+  struct TimeStats {
+    size_t packets{0};
+    size_t fallbacks{0};  // no kernel stamp, or sensor time off
+    double sum_offset{0};  // [s] receive time - sensor time
+    double max_offset{0};  // [s] absolute
+  } time_stats_;
+
+  // Receive thread, rcvbuf_ [bytes] 0 is the system default, cpu_ -1 is not
+  // pinned, priority_ 0 is normal scheduling
+  int rcvbuf_{0};
+  int cpu_{-1};
+  int priority_{0};
+  bool pinned_{false};
+  bool realtime_{false};
+
+  // Scan mode, publish a VelodyneScan per revolution (scan_packets_ == 0) or
+  // per scan_packets_ packets instead of every packet
+  bool publish_scan_{false};
+  int scan_packets_{0};
+
+  // ROS related variables
+  ros::NodeHandle pnh_;
+
+  // Diagnostics updater
+  diagnostic_updater::Updater updater_;
+};
+
+}  // namespace velodyne_puck
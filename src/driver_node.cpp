@@ -0,0 +1,17 @@
+#include "driver.h"
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "velodyne_puck_driver");
+  ros::NodeHandle pnh("~");
+
+  velodyne_puck::Driver node(pnh);
+  node.SetupThread();
+
+  while (ros::ok()) {
+    // poll device until end of file
+    if (!node.Poll()) {
+      ROS_WARN("Stop due to error in Poll()");
+      break;
+    }
+  }
+}
@@ -0,0 +1,53 @@
+#include "driver.h"
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+namespace velodyne_puck {
+
+/// Runs Driver::Poll() on its own thread so that packets published into the
+/// manager are handed to the decoder nodelet by pointer, without
+/// serialization
+class DriverNodelet : public nodelet::Nodelet {
+ public:
+  ~DriverNodelet() override;
+
+ private:
+  void onInit() override;
+  void PollThread();
+
+  std::unique_ptr<Driver> driver_;
+  std::thread poll_thread_;
+  std::atomic_bool running_{false};
+};
+
+DriverNodelet::~DriverNodelet() {
+  running_ = false;
+  // Poll() returns at the latest after its poll() timeout
+  if (poll_thread_.joinable()) poll_thread_.join();
+}
+
+void DriverNodelet::onInit() {
+  driver_.reset(new Driver(getPrivateNodeHandle()));
+  running_ = true;
+  poll_thread_ = std::thread(&DriverNodelet::PollThread, this);
+}
+
+void DriverNodelet::PollThread() {
+  driver_->SetupThread();
+  while (running_ && ros::ok()) {
+    // poll device until end of file
+    if (!driver_->Poll()) {
+      NODELET_WARN("Stop due to error in Poll()");
+      break;
+    }
+  }
+}
+
+}  // namespace velodyne_puck
+
+PLUGINLIB_EXPORT_CLASS(velodyne_puck::DriverNodelet, nodelet::Nodelet)
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace velodyne_puck {
+
+/// Lock free histogram of durations in power of two microsecond buckets.
+/// Record() is wait free and may be called from any thread, Drain() is
+/// called periodically by a single reader and starts a new period. A record
+/// racing with Drain() ends up in either period.
+class LatencyHistogram {
+ public:
+  /// Bucket 0 is [0, 1) us, bucket b is [2^(b-1), 2^b) us, the last one also
+  /// holds everything above 2^22 us (about 4 s)
+  static constexpr int kNumBuckets = 24;
+
+  /// Percentiles are upper bounds of their bucket
+  struct Summary {
+    size_t count{0};
+    double mean_us{0};
+    double max_us{0};
+    double p50_us{0};
+    double p90_us{0};
+    double p99_us{0};
+  };
+
+  LatencyHistogram() {
+    for (auto& bucket : buckets_) bucket.store(0, std::memory_order_relaxed);
+  }
+
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  void Record(int64_t ns) {
+    ns = std::max<int64_t>(ns, 0);
+    const uint64_t us = ns / 1000;
+    const int bucket =
+        us == 0 ? 0 : std::min(64 - __builtin_clzll(us), kNumBuckets - 1);
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+
+    auto max = max_ns_.load(std::memory_order_relaxed);
+    while (ns > max && !max_ns_.compare_exchange_weak(
+                           max, ns, std::memory_order_relaxed)) {
+    }
+  }
+
+  /// Summary of everything recorded since the last Drain()
+  Summary Drain() {
+    std::array<uint32_t, kNumBuckets> counts;
+    Summary summary;
+    for (int b = 0; b < kNumBuckets; ++b) {
+      counts[b] = buckets_[b].exchange(0, std::memory_order_relaxed);
+      summary.count += counts[b];
+    }
+    const auto sum_ns = sum_ns_.exchange(0, std::memory_order_relaxed);
+    summary.max_us = max_ns_.exchange(0, std::memory_order_relaxed) * 1e-3;
+    if (summary.count == 0) return summary;
+
+    summary.mean_us = sum_ns * 1e-3 / summary.count;
+    summary.p50_us = Percentile(counts, summary.count, 0.5);
+    summary.p90_us = Percentile(counts, summary.count, 0.9);
+    summary.p99_us = Percentile(counts, summary.count, 0.99);
+    return summary;
+  }
+
+ private:
+  static double Percentile(const std::array<uint32_t, kNumBuckets>& counts,
+                           size_t total, double p) {
+    const auto rank = static_cast<size_t>(p * total);
+    size_t seen = 0;
+    for (int b = 0; b < kNumBuckets; ++b) {
+      seen += counts[b];
+      if (seen > rank) return static_cast<double>(uint64_t{1} << b);
+    }
+    return static_cast<double>(uint64_t{1} << (kNumBuckets - 1));
+  }
+
+  std::array<std::atomic<uint32_t>, kNumBuckets> buckets_;
+  std::atomic<uint64_t> sum_ns_{0};
+  std::atomic<int64_t> max_ns_{0};
+};
+
+/// Records the lifetime of this object into a histogram
+class ScopedLatency {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit ScopedLatency(LatencyHistogram& histogram)
+      : histogram_(histogram), start_(Clock::now()) {}
+  ~ScopedLatency() {
+    histogram_.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          Clock::now() - start_)
+                          .count());
+  }
+
+  ScopedLatency(const ScopedLatency&) = delete;
+  ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+ private:
+  LatencyHistogram& histogram_;
+  Clock::time_point start_;
+};
+
+}  // namespace velodyne_puck
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "constants.h"
+
+namespace velodyne_puck {
+
+/// 9.3.1.6 Factory Bytes, product id of each supported sensor model. The
+/// Puck LITE reports the same id as the VLP-16 and has the same geometry.
+enum class Model : uint8_t {
+  kUnknown = 0,
+  kVlp16 = 34,      // also Puck LITE
+  kPuckHiRes = 36,  // VLP-16 Hi-Res
+};
+
+/// Description of a sensor model. Every model must share the VLP-16 packet
+/// layout and firing timing, which scan buffers, the decode kernels and the
+/// packet loss detection are built for, so all of them are decoded by the
+/// same code and only the beam geometry depends on the model.
+struct ModelInfo {
+  Model model;
+  const char* name;
+  float max_elevation;  // [rad] of image row 0, the highest laser
+  float min_elevation;  // [rad] of the last row, the lowest laser
+  int lasers;
+  double single_firing_ns;  // [ns]
+  double firing_cycle_ns;   // [ns]
+};
+
+/// Supported models, the first one is the default
+static constexpr ModelInfo kModels[] = {
+    {Model::kVlp16, "VLP-16", deg2rad(15.0f), deg2rad(-15.0f), 16, 2304,
+     55296},
+    {Model::kPuckHiRes, "Puck Hi-Res", deg2rad(10.0f), deg2rad(-10.0f), 16,
+     2304, 55296},
+};
+static constexpr int kNumModels = sizeof(kModels) / sizeof(kModels[0]);
+
+/// Whether models [i, kNumModels) have the VLP-16 layout
+constexpr bool HaveVlp16Layout(int i = 0) {
+  return i == kNumModels ||
+         (kModels[i].lasers == kFiringsPerSequence &&
+          kModels[i].single_firing_ns == kSingleFiringNs &&
+          kModels[i].firing_cycle_ns == kFiringCycleNs &&
+          HaveVlp16Layout(i + 1));
+}
+
+static_assert(HaveVlp16Layout(), "All models need the VLP-16 layout");
+static_assert(kModels[0].max_elevation == kMaxElevation &&
+                  kModels[0].min_elevation == kMinElevation,
+              "VLP-16 elevations");
+
+/// Model of a product id, kUnknown if it is not supported
+inline Model ProductModel(uint8_t product_id) {
+  for (const auto& info : kModels) {
+    if (static_cast<uint8_t>(info.model) == product_id) return info.model;
+  }
+  return Model::kUnknown;
+}
+
+/// Description of model, that of the VLP-16 if the model is unknown
+inline const ModelInfo& GetModelInfo(Model model) {
+  for (const auto& info : kModels) {
+    if (info.model == model) return info;
+  }
+  return kModels[0];
+}
+
+inline const char* ModelName(Model model) {
+  return model == Model::kUnknown ? "unknown" : GetModelInfo(model).name;
+}
+
+/// Nominal elevation [rad] of image row r of model, that of the VLP-16 if
+/// the model is unknown
+inline float NominalElevation(Model model, int r) {
+  const auto& info = GetModelInfo(model);
+  return info.max_elevation -
+         r * (info.max_elevation - info.min_elevation) / (info.lasers - 1);
+}
+
+}  // namespace velodyne_puck
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "constants.h"
+
+namespace velodyne_puck {
+
+/// All of these uses laser index from velodyne which is interleaved
+
+/// 9.3.1.3 Data Point
+/// A data point is a measurement by one laser channel of a relection of a
+/// laser pulse
+struct DataPoint {
+  uint16_t distance;
+  uint8_t reflectivity;
+} __attribute__((packed));
+static_assert(sizeof(DataPoint) == 3, "sizeof(DataPoint) != 3");
+
+/// 9.3.1.1 Firing Sequence
+/// A firing sequence occurs when all the lasers in a sensor are fired. There
+/// are 16 firings per cycle for VLP-16
+struct FiringSequence {
+  DataPoint points[kFiringsPerSequence];  // 16
+} __attribute__((packed));
+static_assert(sizeof(FiringSequence) == 48, "sizeof(FiringSequence) != 48");
+
+/// 9.3.1.4 Azimuth
+/// A two-byte azimuth value (alpha) appears after the flag bytes at the
+/// beginning of each data block
+///
+/// 9.3.1.5 Data Block
+/// The information from 2 firing sequences of 16 lasers is contained in each
+/// data block. Each packet contains the data from 24 firing sequences in 12
+/// data blocks.
+struct DataBlock {
+  uint16_t flag;
+  uint16_t azimuth;                              // [0, 35999]
+  FiringSequence sequences[kSequencesPerBlock];  // 2
+} __attribute__((packed));
+static_assert(sizeof(DataBlock) == 100, "sizeof(DataBlock) != 100");
+
+struct Packet {
+  DataBlock blocks[kBlocksPerPacket];  // 12
+  /// The four-byte time stamp is a 32-bit unsigned integer marking the moment
+  /// of the first data point in the first firing sequcne of the first data
+  /// block. The time stamp’s value is the number of microseconds elapsed
+  /// since the top of the hour.
+  uint32_t stamp;
+  uint8_t factory[2];
+} __attribute__((packed));
+static_assert(sizeof(Packet) == 1206, "sizeof(Packet) != 1206");
+
+/// 9.3.1.6 Factory Bytes
+static constexpr uint8_t kReturnModeStrongest = 55;
+static constexpr uint8_t kReturnModeLast = 56;
+static constexpr uint8_t kReturnModeDual = 57;
+// Product ids are the values of Model in model.h
+
+/// 9.3.1.7 Dual Return Mode
+/// Blocks come in pairs of the same azimuth, the even one holds the last
+/// return and the odd one the strongest, or the second strongest if the
+/// strongest is also the last. Both hold the same if there is only one
+/// return. A packet then covers half as many firing sequences.
+inline int BlocksPerColumn(uint8_t return_mode) {
+  return return_mode == kReturnModeDual ? 2 : 1;
+}
+
+/// Firing sequences, i.e. scan columns, per packet
+inline int ColumnsPerPacket(uint8_t return_mode) {
+  return kSequencesPerPacket / BlocksPerColumn(return_mode);
+}
+
+}  // namespace velodyne_puck
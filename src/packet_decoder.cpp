@@ -0,0 +1,317 @@
+#include "packet_decoder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace velodyne_puck {
+
+// Sensor time stamp wraps around every hour
+static constexpr int64_t kHourUs = 3600000000ll;
+static constexpr int64_t kMaxStampGapUs = 1000000;
+
+PacketDecoder::PacketDecoder(SweepFn sweep_fn, SectorFn sector_fn)
+    : sweep_fn_(std::move(sweep_fn)),
+      sector_fn_(std::move(sector_fn)),
+      decode_sequence_(GetDecodeSequence()) {}
+
+void PacketDecoder::Reset(ScanBuffer* scan, const DecodeOptions& options) {
+  scan_ = scan;
+  options_ = options;
+  limits_ = RangeLimits(options.min_range, options.max_range,
+                        options.distance_bias);
+  // Start over at the next cut
+  synced_ = false;
+  ResetSweep();
+}
+
+DecodeResult PacketDecoder::Decode(const uint8_t* data, size_t size,
+                                   uint64_t time) {
+  if (size != sizeof(Packet)) return DecodeResult::kInvalidSize;
+  const auto& packet = *reinterpret_cast<const Packet*>(data);
+
+  // Check return mode and product id
+  const auto return_mode = packet.factory[0];
+  if (return_mode != kReturnModeStrongest && return_mode != kReturnModeLast &&
+      return_mode != kReturnModeDual) {
+    return DecodeResult::kInvalidReturnMode;
+  }
+  const auto model = ProductModel(packet.factory[1]);
+  if (model == Model::kUnknown) return DecodeResult::kInvalidProductId;
+
+  // Columns per packet and layers change with the return mode, the beam
+  // geometry with the model, start over
+  if (return_mode != return_mode_ || model != model_) {
+    return_mode_ = return_mode;
+    model_ = model;
+    synced_ = false;
+    ResetSweep();
+  }
+
+  ++stats_.packets;
+  const auto lost = CountLostPackets(packet.stamp);
+  if (lost > 0) FillGap(packet, lost, time);
+  DecodeAndFill(packet, time);
+
+  if (options_.sector_packets > 0 &&
+      ++sector_num_packets_ >= options_.sector_packets) {
+    FinishSector();
+  }
+
+  // Full sweeps are cut on azimuth in BeginColumn
+  if (!options_.full_sweep && curr_col_ >= options_.image_width) {
+    FinishSweep();
+  }
+
+  return DecodeResult::kOk;
+}
+
+void PacketDecoder::DecodeAndFill(const Packet& packet, uint64_t time) {
+  // transform
+  //            ^ x_l
+  //            | -> /
+  //            | a /
+  //            |  /
+  //            | /
+  // <----------o
+  // y_l
+
+  // In dual return mode block iblk holds the last and iblk + 1 the strongest
+  // return of the same firings
+  const int step = BlocksPerColumn(return_mode_);
+  const bool dual = step > 1;
+  const int last_block = kBlocksPerPacket - step;
+
+  // Rpm decides how many columns a full sweep needs
+  rpm_ = EstimateRpm(packet.blocks[0].azimuth,
+                     packet.blocks[last_block].azimuth, last_block / step);
+
+  DecodedSequence decoded, decoded2;
+
+  // For each data block, 12 total, or each pair of them
+  for (int iblk = 0; iblk < kBlocksPerPacket; iblk += step) {
+    const auto& block = packet.blocks[iblk + step - 1];
+    const auto raw_azimuth = block.azimuth;         // nominal azimuth [0,35999]
+    const auto azimuth = Raw2Azimuth(raw_azimuth);  // nominal azimuth [0, 2pi)
+
+    stats_.invalid_azimuths += raw_azimuth > kMaxRawAzimuth;
+    stats_.invalid_blocks += block.flag != UPPER_BANK;
+
+    float azimuth_gap{0};
+    if (iblk == last_block) {
+      // Last block, 12th
+      const auto& prev_block = packet.blocks[iblk - step];
+      const auto prev_azimuth = Raw2Azimuth(prev_block.azimuth);
+      azimuth_gap = azimuth - prev_azimuth;
+    } else {
+      // First 11 blocks
+      const auto& next_block = packet.blocks[iblk + step];
+      const auto next_azimuth = Raw2Azimuth(next_block.azimuth);
+      azimuth_gap = next_azimuth - azimuth;
+    }
+
+    // Adjust for azimuth rollover from 2pi to 0
+    if (azimuth_gap < 0) azimuth_gap += kTau;
+    const auto half_azimuth_gap = azimuth_gap / 2;
+
+    // for each firing sequence in the data block, 2
+    for (int iseq = 0; iseq < kSequencesPerBlock; ++iseq, ++curr_col_) {
+      const auto col = iblk / step * 2 + iseq;
+      const auto col_azimuth = azimuth + half_azimuth_gap * iseq;
+      BeginColumn(col_azimuth, time + col * kFiringCycleNs);
+
+      // unpack all 16 laser beams at once, already in row order
+      auto& scan = *scan_;
+      const auto& seq = block.sequences[iseq];
+      scan.num_valid += decode_sequence_(
+          reinterpret_cast<const uint8_t*>(seq.points), col_azimuth,
+          kSingleFiringRatio * half_azimuth_gap, limits_, decoded);
+
+      for (int r = 0; r < kFiringsPerSequence; ++r) {
+        const auto i = scan.Index(r, curr_col_);
+        scan.range[i] = decoded.range[r];
+        scan.intensity[i] = decoded.intensity[r];
+        scan.azimuth[i] = decoded.azimuth[r];
+      }
+
+      if (!dual) continue;
+
+      // Same firings, so azimuth is the same as the first layer
+      const auto& seq2 = packet.blocks[iblk].sequences[iseq];
+      scan.num_valid2 += decode_sequence_(
+          reinterpret_cast<const uint8_t*>(seq2.points), col_azimuth,
+          kSingleFiringRatio * half_azimuth_gap, limits_, decoded2);
+
+      for (int r = 0; r < kFiringsPerSequence; ++r) {
+        const auto i = scan.Index(r, curr_col_);
+        scan.range2[i] = decoded2.range[r];
+        scan.intensity2[i] = decoded2.intensity[r];
+      }
+    }
+  }
+
+  // Mean azimuth between columns over the whole packet, and where the first
+  // column of the next packet is expected
+  const auto first_azimuth = Raw2Azimuth(packet.blocks[0].azimuth);
+  const auto last_azimuth = Raw2Azimuth(packet.blocks[last_block].azimuth);
+  auto packet_gap = last_azimuth - first_azimuth;
+  if (packet_gap < 0) packet_gap += kTau;
+  col_azimuth_step_ = packet_gap / (last_block / step * kSequencesPerBlock);
+  next_col_azimuth_ = last_azimuth + kSequencesPerBlock * col_azimuth_step_;
+}
+
+void PacketDecoder::FillGap(const Packet& packet, int lost, uint64_t time) {
+  // The stamps tell that packets are missing, the azimuths where the
+  // missing columns go. Trust the azimuths unless they disagree by a packet
+  // or more, e.g. if more than a revolution is missing.
+  const auto cols_per_packet = ColumnsPerPacket(return_mode_);
+  int num_cols = lost * cols_per_packet;
+  if (col_azimuth_step_ > 0) {
+    const auto delta = std::fmod(
+        Raw2Azimuth(packet.blocks[0].azimuth) - next_col_azimuth_ + 2 * kTau,
+        kTau);
+    const auto azimuth_cols =
+        static_cast<int>(std::lround(delta / col_azimuth_step_));
+    if (std::abs(azimuth_cols - num_cols) < cols_per_packet) {
+      num_cols = azimuth_cols;
+    }
+  }
+
+  // More than one revolution is gone, start over at the next cut
+  if (num_cols >= SweepColumns(std::max(rpm_, kMinRpm))) {
+    ++stats_.resyncs;
+    synced_ = false;
+    // Azimuth jumped anywhere, only a wraparound after this is a cut
+    prev_relative_azimuth_ = 0;
+    ResetSweep();
+    return;
+  }
+
+  // Missing columns stay NaN, with azimuth and time counted back from this
+  // packet
+  const auto first_azimuth = Raw2Azimuth(packet.blocks[0].azimuth);
+  for (int i = num_cols; i > 0; --i, ++curr_col_) {
+    auto azimuth = std::fmod(first_azimuth - i * col_azimuth_step_, kTau);
+    if (azimuth < 0) azimuth += kTau;
+    BeginColumn(azimuth, time - static_cast<uint64_t>(i * kFiringCycleNs));
+    ++stats_.filled_columns;
+  }
+}
+
+void PacketDecoder::BeginColumn(float azimuth, uint64_t time) {
+  if (options_.sector_packets == 0 && options_.sector_angle > 0) {
+    // Sectors are counted from the cut angle, so a full sweep is always cut
+    // on a sector boundary
+    const int sector = static_cast<int>(rad2deg(RelativeAzimuth(azimuth)) /
+                                        options_.sector_angle);
+    if (sector != sector_index_) {
+      sector_index_ = sector;
+      FinishSector();
+    }
+  }
+
+  if (options_.full_sweep) {
+    // Cut exactly where azimuth passes the cut angle
+    if (IsSweepStart(azimuth)) {
+      if (synced_) {
+        FinishSweep();
+      } else {
+        // Drop the partial revolution before the first cut
+        synced_ = true;
+        ResetSweep();
+      }
+    } else if (curr_col_ >= scan_->cols) {
+      // Longer than one revolution at rpm_, wait for the next cut
+      ++stats_.resyncs;
+      synced_ = false;
+      ResetSweep();
+    }
+  } else if (curr_col_ >= scan_->cols) {
+    // Only after filling a gap, otherwise cut after the packet
+    FinishSweep();
+  }
+
+  auto& scan = *scan_;
+  scan.timestamps[curr_col_] = time;
+  scan.azimuths[curr_col_] = azimuth;
+}
+
+int PacketDecoder::CountLostPackets(uint32_t stamp) {
+  if (!has_prev_stamp_) {
+    has_prev_stamp_ = true;
+    prev_stamp_ = stamp;
+    return 0;
+  }
+
+  // Stamp wraps around at the top of the hour
+  auto delta_us = static_cast<int64_t>(stamp) - prev_stamp_;
+  if (delta_us < -kMaxStampGapUs) delta_us += kHourUs;
+  prev_stamp_ = stamp;
+
+  // Out of order, or a jump like a sensor restart or a replay loop, is not
+  // counted as loss
+  if (delta_us < 0 || delta_us > kMaxStampGapUs) return 0;
+
+  const auto packet_ns = ColumnsPerPacket(return_mode_) * kFiringCycleNs;
+  const auto packets =
+      static_cast<int>(std::lround(delta_us * 1e3 / packet_ns));
+  if (packets <= 1) return 0;
+  stats_.lost_packets += packets - 1;
+  return packets - 1;
+}
+
+float PacketDecoder::RelativeAzimuth(float azimuth) const {
+  auto relative = std::fmod(azimuth - deg2rad(options_.cut_angle), kTau);
+  if (relative < 0) relative += kTau;
+  return relative;
+}
+
+bool PacketDecoder::IsSweepStart(float azimuth) {
+  // Relative azimuth wraps around once per revolution. Small backward jitter
+  // is not a wraparound.
+  const auto relative = RelativeAzimuth(azimuth);
+  const bool start = relative < prev_relative_azimuth_ - M_PI;
+  prev_relative_azimuth_ = relative;
+  return start;
+}
+
+int PacketDecoder::SweepCapacity() const {
+  if (!options_.full_sweep) return options_.image_width;
+
+  // One revolution at the estimated rpm, plus one packet of margin
+  const auto rpm = std::max(std::min(rpm_, kMaxRpm), kMinRpm);
+  const auto cols_per_packet = ColumnsPerPacket(return_mode_);
+  const auto packets =
+      (SweepColumns(rpm) + cols_per_packet - 1) / cols_per_packet;
+  return (packets + 1) * cols_per_packet;
+}
+
+void PacketDecoder::FinishSweep() {
+  // Flush the last sector before the buffer is handed over
+  if (SectorMode()) FinishSector();
+
+  scan_->Shrink(curr_col_);
+  ++stats_.sweeps;
+  scan_ = sweep_fn_(*scan_);
+  ResetSweep();
+}
+
+void PacketDecoder::FinishSector() {
+  const auto col_begin = sector_begin_;
+  sector_begin_ = curr_col_;
+  sector_num_packets_ = 0;
+  if (col_begin < curr_col_ && sector_fn_) {
+    sector_fn_(*scan_, col_begin, curr_col_);
+  }
+}
+
+void PacketDecoder::ResetSweep() {
+  curr_col_ = 0;
+  sector_begin_ = 0;
+  sector_num_packets_ = 0;
+  scan_->Reset(SweepCapacity(), BlocksPerColumn(return_mode_));
+  scan_->model = model_;
+  scan_->sweep_id = ++sweep_id_;
+}
+
+}  // namespace velodyne_puck
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "decode_kernel.h"
+#include "packet.h"
+#include "scan.h"
+
+#include <cstddef>
+#include <functional>
+
+namespace velodyne_puck {
+
+/// Everything PacketDecoder needs to know, a subset of VelodynePuckConfig
+struct DecodeOptions {
+  float min_range{0.5};            // [m]
+  float max_range{kDistanceMax};   // [m]
+  /// [m] of each row, added to the distance before it is checked against
+  /// min_range and max_range, see BeamTable
+  float distance_bias[kFiringsPerSequence]{};
+  int image_width{1024};           // columns per sweep if not full_sweep
+  bool full_sweep{true};           // one revolution per sweep
+  double cut_angle{0};             // [deg] where full sweeps start
+  double sector_angle{0};          // [deg] per sector, 0 is off
+  int sector_packets{0};           // packets per sector, 0 is off
+};
+
+enum class DecodeResult {
+  kOk,
+  kInvalidSize,
+  kInvalidReturnMode,  // neither strongest, last nor dual return
+  kInvalidProductId,   // not a VLP-16, Puck LITE or Puck Hi-Res
+};
+
+/// Counters of recoverable problems since construction
+struct DecodeStats {
+  size_t packets{0};
+  size_t sweeps{0};
+  size_t resyncs{0};           // full sweep overflowed, waiting for next cut
+  size_t invalid_azimuths{0};  // raw azimuth above 35999
+  size_t invalid_blocks{0};    // block flag is not the upper bank
+  size_t lost_packets{0};      // missing from the sensor time stamps
+  size_t filled_columns{0};    // left NaN in place of lost packets
+};
+
+/// Decodes raw VLP-16, Puck LITE and Puck Hi-Res packets into scan buffers
+/// and cuts them into sweeps (and optionally sectors), no ROS involved. Dual
+/// return packets fill both layers of the scan buffer. Not thread safe,
+/// packets must be decoded in order.
+class PacketDecoder {
+ public:
+  /// Called with each finished sweep, returns the buffer to decode the next
+  /// sweep into, which may be the same one once the caller is done with it
+  using SweepFn = std::function<ScanBuffer*(ScanBuffer& scan)>;
+  /// Called with columns [col_begin, col_end) of the sweep being decoded
+  using SectorFn =
+      std::function<void(const ScanBuffer& scan, int col_begin, int col_end)>;
+
+  explicit PacketDecoder(SweepFn sweep_fn, SectorFn sector_fn = SectorFn());
+
+  /// Start over decoding into scan with options, drops the partial sweep.
+  /// Must be called before the first Decode().
+  void Reset(ScanBuffer* scan, const DecodeOptions& options);
+
+  /// Decode one packet of size bytes received at time [ns]
+  DecodeResult Decode(const uint8_t* data, size_t size, uint64_t time);
+
+  const DecodeOptions& options() const { return options_; }
+  const DecodeStats& stats() const { return stats_; }
+  /// Motor speed estimated from the last packet
+  int rpm() const { return rpm_; }
+  /// Of the last packet, 0 before the first one
+  uint8_t return_mode() const { return return_mode_; }
+  /// Of the last packet, kUnknown before the first one
+  Model model() const { return model_; }
+  /// Columns of the current sweep decoded so far
+  int num_cols() const { return curr_col_; }
+  const char* kernel_name() const { return GetDecodeSequenceName(); }
+
+ private:
+  /// Same for every model, they share the VLP-16 layout, see ModelInfo
+  void DecodeAndFill(const Packet& packet, uint64_t time);
+  /// Number of packets missing between the previous packet and stamp [us]
+  int CountLostPackets(uint32_t stamp);
+  /// Leave NaN columns for lost packets before packet, so every column stays
+  /// at its azimuth and the sweep is still cut at the right place
+  void FillGap(const Packet& packet, int lost, uint64_t time);
+  /// Cut sectors and sweeps as needed and start column curr_col_ at azimuth
+  /// and time [ns]
+  void BeginColumn(float azimuth, uint64_t time);
+
+  /// Azimuth relative to the cut angle in [0, 2pi)
+  float RelativeAzimuth(float azimuth) const;
+  /// Whether a column at azimuth starts a new revolution at the cut angle
+  bool IsSweepStart(float azimuth);
+  /// Columns to allocate for a sweep, one revolution at rpm_ in full sweep
+  int SweepCapacity() const;
+  bool SectorMode() const {
+    return options_.sector_packets > 0 || options_.sector_angle > 0;
+  }
+
+  void FinishSweep();
+  void FinishSector();
+  /// Start a new sweep in scan_
+  void ResetSweep();
+
+  SweepFn sweep_fn_;
+  SectorFn sector_fn_;
+  DecodeSequenceFn decode_sequence_{DecodeSequenceScalar};
+
+  DecodeOptions options_;
+  RangeLimits limits_;  // of options_
+  DecodeStats stats_;
+  ScanBuffer* scan_{nullptr};
+  uint8_t return_mode_{0};
+  Model model_{Model::kUnknown};
+
+  // Sensor time stamp of the previous packet [us since the top of the hour]
+  bool has_prev_stamp_{false};
+  uint32_t prev_stamp_{0};
+
+  // Full sweep, rpm_ is estimated from every packet, synced_ once the first
+  // cut was seen
+  int rpm_{kMinRpm};
+  bool synced_{false};
+  float prev_relative_azimuth_{0};
+  int curr_col_{0};
+  // Of the last sweep started, never reset so that ids are unique
+  uint64_t sweep_id_{0};
+
+  // Expected azimuth of the next column and azimuth between two columns,
+  // from the previous packet
+  float next_col_azimuth_{0};
+  float col_azimuth_step_{0};
+
+  // Sector mode, columns since sector_begin_ are handed out every
+  // sector_angle degrees or every sector_packets packets
+  int sector_begin_{0};
+  int sector_index_{0};
+  int sector_num_packets_{0};
+};
+
+}  // namespace velodyne_puck
@@ -0,0 +1,188 @@
+#include "pcap.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ros/ros.h>
+
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+namespace velodyne_puck {
+
+// https://wiki.wireshark.org/Development/LibpcapFileFormat
+static constexpr uint32_t kPcapMagicUs = 0xa1b2c3d4;
+static constexpr uint32_t kPcapMagicNs = 0xa1b23c4d;
+static constexpr size_t kGlobalHeaderSize = 24;
+static constexpr size_t kRecordHeaderSize = 16;
+
+// Link types
+static constexpr uint32_t kLinkEthernet = 1;
+static constexpr uint32_t kLinkRaw = 101;
+static constexpr uint32_t kLinkLinuxSll = 113;
+
+static constexpr uint16_t kEtherTypeIpv4 = 0x0800;
+static constexpr uint16_t kEtherTypeVlan = 0x8100;
+static constexpr uint8_t kIpProtocolUdp = 17;
+static constexpr size_t kIpv4MinHeaderSize = 20;
+static constexpr size_t kUdpHeaderSize = 8;
+
+// Device time stamp wraps around every hour
+static constexpr double kMaxGapUs = 1e6;
+static constexpr uint32_t kHourUs = 3600000000u;
+
+/// Network byte order
+inline uint16_t Read16Be(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+PcapReader::PcapReader(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    ROS_ERROR("Failed to open pcap %s: %s", path.c_str(), strerror(errno));
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t)kGlobalHeaderSize) {
+    ROS_ERROR("Pcap %s is too short", path.c_str());
+    close(fd);
+    return;
+  }
+
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the file is closed
+  close(fd);
+  if (addr == MAP_FAILED) {
+    ROS_ERROR("Failed to mmap pcap %s: %s", path.c_str(), strerror(errno));
+    return;
+  }
+  madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+  data_ = static_cast<const uint8_t *>(addr);
+  size_ = st.st_size;
+
+  const auto magic = Read32(0);
+  if (magic == __builtin_bswap32(kPcapMagicUs) ||
+      magic == __builtin_bswap32(kPcapMagicNs)) {
+    swapped_ = true;
+  } else if (magic != kPcapMagicUs && magic != kPcapMagicNs) {
+    ROS_ERROR("Not a pcap file (pcapng is not supported): %s", path.c_str());
+    munmap(addr, size_);
+    data_ = nullptr;
+    return;
+  }
+
+  link_type_ = Read32(20);
+  if (link_type_ != kLinkEthernet && link_type_ != kLinkRaw &&
+      link_type_ != kLinkLinuxSll) {
+    ROS_ERROR("Unsupported pcap link type: %u", link_type_);
+    munmap(addr, size_);
+    data_ = nullptr;
+    return;
+  }
+
+  ROS_INFO("pcap: %s, %zu bytes, link type %u", path.c_str(), size_,
+           link_type_);
+  Rewind();
+}
+
+PcapReader::~PcapReader() {
+  if (data_) munmap(const_cast<uint8_t *>(data_), size_);
+}
+
+void PcapReader::Rewind() { offset_ = kGlobalHeaderSize; }
+
+uint32_t PcapReader::Read32(size_t offset) const {
+  uint32_t value;
+  memcpy(&value, data_ + offset, sizeof(value));
+  return swapped_ ? __builtin_bswap32(value) : value;
+}
+
+bool PcapReader::Next(Datagram &datagram) {
+  if (!ok()) return false;
+
+  while (offset_ + kRecordHeaderSize <= size_) {
+    const auto incl_len = Read32(offset_ + 8);
+    const auto *frame = data_ + offset_ + kRecordHeaderSize;
+    offset_ += kRecordHeaderSize + incl_len;
+
+    // Truncated last record
+    if (offset_ > size_) break;
+    if (ParseFrame(frame, incl_len, datagram)) return true;
+  }
+
+  offset_ = size_;
+  return false;
+}
+
+bool PcapReader::ParseFrame(const uint8_t *frame, size_t size,
+                            Datagram &datagram) const {
+  // Link layer
+  size_t ip = 0;
+  if (link_type_ == kLinkEthernet) {
+    ip = 14;
+    if (size < ip) return false;
+    auto ether_type = Read16Be(frame + 12);
+    // 802.1Q tags
+    while (ether_type == kEtherTypeVlan && size >= ip + 4) {
+      ether_type = Read16Be(frame + ip + 2);
+      ip += 4;
+    }
+    if (ether_type != kEtherTypeIpv4) return false;
+  } else if (link_type_ == kLinkLinuxSll) {
+    ip = 16;
+    if (size < ip || Read16Be(frame + 14) != kEtherTypeIpv4) return false;
+  }
+
+  // IPv4, unfragmented UDP only
+  if (size < ip + kIpv4MinHeaderSize || (frame[ip] >> 4) != 4) return false;
+  // Header length in 32-bit words, less than 5 is a corrupt header
+  const size_t ihl = (frame[ip] & 0x0f) * 4;
+  if (ihl < kIpv4MinHeaderSize || size < ip + ihl) return false;
+  if (frame[ip + 9] != kIpProtocolUdp) return false;
+  if (Read16Be(frame + ip + 6) & 0x3fff) return false;  // MF or offset
+
+  const auto udp = ip + ihl;
+  if (size < udp + kUdpHeaderSize) return false;
+  const size_t udp_len = Read16Be(frame + udp + 4);
+  if (udp_len < kUdpHeaderSize || size < udp + udp_len) return false;
+
+  memcpy(&datagram.src_ip, frame + ip + 12, sizeof(datagram.src_ip));
+  datagram.dst_port = Read16Be(frame + udp + 2);
+  datagram.payload = frame + udp + kUdpHeaderSize;
+  datagram.size = udp_len - kUdpHeaderSize;
+  return true;
+}
+
+void ReplayPacer::Wait(uint32_t stamp_us) {
+  if (rate_ <= 0) return;
+
+  if (!started_) {
+    started_ = true;
+    prev_stamp_us_ = stamp_us;
+    elapsed_us_ = 0;
+    start_ = Clock::now();
+    return;
+  }
+
+  auto delta_us = static_cast<double>(stamp_us) - prev_stamp_us_;
+  if (delta_us < -kMaxGapUs) delta_us += kHourUs;
+  prev_stamp_us_ = stamp_us;
+
+  // Out of order or a discontinuity, carry on from here without waiting
+  if (delta_us < 0 || delta_us > kMaxGapUs) {
+    ROS_WARN_THROTTLE(1, "Replay time jumped by %.0f us", delta_us);
+    start_ = Clock::now() - std::chrono::microseconds(
+                                static_cast<int64_t>(elapsed_us_ / rate_));
+    return;
+  }
+
+  elapsed_us_ += delta_us;
+  std::this_thread::sleep_until(
+      start_ +
+      std::chrono::microseconds(static_cast<int64_t>(elapsed_us_ / rate_)));
+}
+
+}  // namespace velodyne_puck
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace velodyne_puck {
+
+/// Reads UDP datagrams from a classic libpcap capture file (not pcapng). The
+/// file is memory-mapped, so datagrams point straight into the mapping.
+/// Supports Ethernet (with VLAN tags), Linux cooked and raw IPv4 captures.
+class PcapReader {
+ public:
+  struct Datagram {
+    const uint8_t *payload{nullptr};  // valid as long as the reader
+    size_t size{0};
+    in_addr src_ip;
+    uint16_t dst_port{0};
+  };
+
+  /// Maps the file at path, check ok() before reading
+  explicit PcapReader(const std::string &path);
+  ~PcapReader();
+
+  PcapReader(const PcapReader &) = delete;
+  PcapReader operator=(const PcapReader &) = delete;
+
+  bool ok() const { return data_ != nullptr; }
+
+  /// Next UDP over IPv4 datagram, everything else is skipped. Returns false
+  /// at the end of the file.
+  bool Next(Datagram &datagram);
+
+  /// Start over at the first record
+  void Rewind();
+
+ private:
+  uint32_t Read32(size_t offset) const;
+  /// Datagram in the link layer frame, false if it is not UDP over IPv4
+  bool ParseFrame(const uint8_t *frame, size_t size, Datagram &datagram) const;
+
+  const uint8_t *data_{nullptr};
+  size_t size_{0};
+  size_t offset_{0};
+  bool swapped_{false};  // written on a machine of the other endianness
+  uint32_t link_type_{0};
+};
+
+/// Paces replayed packets to the device clock, Packet::stamp is micro
+/// seconds since the top of the hour. Jumps of more than a second, e.g. the
+/// hour wrapping around or a file restarting, are not slept for.
+class ReplayPacer {
+ public:
+  /// rate 1 is real time, 2 twice as fast, 0 or less does not wait
+  explicit ReplayPacer(double rate = 1.0) : rate_(rate) {}
+
+  void Reset() { started_ = false; }
+
+  /// Sleep until a packet stamped stamp_us is due
+  void Wait(uint32_t stamp_us);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  double rate_{1.0};
+  bool started_{false};
+  uint32_t prev_stamp_us_{0};
+  double elapsed_us_{0};  // device time since start
+  Clock::time_point start_;
+};
+
+}  // namespace velodyne_puck
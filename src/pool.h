@@ -0,0 +1,83 @@
+#pragma once
+
+#include <boost/shared_ptr.hpp>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace velodyne_puck {
+
+/// Pool of reusable objects handed out as boost::shared_ptr, so they can be
+/// published as ROS messages. An object goes back to the pool once the last
+/// reference, e.g. a downstream ConstPtr, is released. Objects released after
+/// the pool is gone are simply deleted.
+template <typename T>
+class Pool {
+ public:
+  using Ptr = boost::shared_ptr<T>;
+
+  Pool() : state_(std::make_shared<State>()) {}
+
+  Pool(const Pool&) = delete;
+  Pool& operator=(const Pool&) = delete;
+
+  /// Preallocate n objects
+  void Reserve(size_t n) { Reserve(n, T()); }
+
+  /// Preallocate n copies of prototype, e.g. with buffers of their final size
+  void Reserve(size_t n, const T& prototype) {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    while (state_->free.size() < n) state_->free.emplace_back(new T(prototype));
+  }
+
+  /// A released object if there is one (hit), otherwise a new one (miss). The
+  /// object keeps whatever content it had when it was released.
+  Ptr Get() {
+    T* obj = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      if (state_->free.empty()) {
+        ++state_->misses;
+      } else {
+        ++state_->hits;
+        obj = state_->free.back().release();
+        state_->free.pop_back();
+      }
+    }
+    if (obj == nullptr) obj = new T;
+
+    const std::weak_ptr<State> weak_state = state_;
+    return Ptr(obj, [weak_state](T* released) {
+      const auto state = weak_state.lock();
+      if (!state) {
+        delete released;
+        return;
+      }
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->free.emplace_back(released);
+    });
+  }
+
+  size_t hits() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->hits;
+  }
+
+  size_t misses() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->misses;
+  }
+
+ private:
+  struct State {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<T>> free;
+    size_t hits{0};
+    size_t misses{0};
+  };
+
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace velodyne_puck
@@ -0,0 +1,229 @@
+#include "replay_report.h"
+
+#include <sys/resource.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+
+namespace velodyne_puck {
+
+using namespace sensor_msgs;
+
+// Counters the decoder reports per diagnostic period, summed over the run
+static const char* const kDecoderCounters[] = {
+    "Packets",      "Lost packets",           "Filled columns",
+    "Late packets", "Waits for a free sweep", "Resyncs",
+    "Sweeps published"};
+
+/// User plus system cpu time of the process [s]
+double ProcessCpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+/// Whether str ends with ": " + suffix, the name of a diagnostic task
+/// prefixed by the node name
+bool IsTask(const std::string& str, const std::string& suffix) {
+  const auto name = ": " + suffix;
+  return str.size() >= name.size() &&
+         str.compare(str.size() - name.size(), name.size(), name) == 0;
+}
+
+ReplayReport::ReplayReport(const ros::NodeHandle& nh,
+                           const ros::NodeHandle& pnh)
+    : nh_(nh), pnh_(pnh) {
+  std::vector<std::string> names;
+  if (!pnh_.getParam("sensors", names) || names.empty()) {
+    ROS_FATAL("No sensors to report on");
+    ros::shutdown();
+    return;
+  }
+
+  std::string decoder;
+  double warmup, duration;
+  pnh_.param<std::string>("decoder", decoder, "velodyne_puck_decoder");
+  pnh_.param("warmup", warmup, 5.0);
+  pnh_.param("duration", duration, 30.0);
+  pnh_.param<std::string>("output", output_, "replay_report.json");
+  pnh_.param<std::string>("pcap", pcap_, "");
+  pnh_.param("pcap_rate", pcap_rate_, 1.0);
+  pnh_.param("max_latency_us", max_latency_us_, 0.0);
+  pnh_.param("max_drops", max_drops_, -1);
+  ROS_INFO("Report on %zu sensors of %s after %f s for %f s into %s",
+           names.size(), decoder.c_str(), warmup, duration, output_.c_str());
+
+  for (const auto& name : names) {
+    sensors_.emplace_back(new Sensor);
+    auto& sensor = *sensors_.back();
+    sensor.name = name;
+
+    ros::NodeHandle sensor_nh(nh_, decoder + "/" + name);
+    sensor.cloud_sub = sensor_nh.subscribe<PointCloud2>(
+        "cloud", 10, [this, &sensor](const PointCloud2ConstPtr& msg) {
+          CloudCb(sensor, msg);
+        });
+    sensor.image_sub = sensor_nh.subscribe<Image>(
+        "image", 10,
+        [this, &sensor](const ImageConstPtr& msg) { ImageCb(sensor, msg); });
+  }
+  diag_sub_ = ros::NodeHandle().subscribe("/diagnostics", 100,
+                                          &ReplayReport::DiagnosticsCb, this);
+
+  start_timer_ = nh_.createWallTimer(
+      ros::WallDuration(warmup),
+      [this](const ros::WallTimerEvent&) { Start(); }, true);
+  finish_timer_ = nh_.createWallTimer(
+      ros::WallDuration(warmup + duration),
+      [this](const ros::WallTimerEvent&) { Finish(); }, true);
+}
+
+void ReplayReport::CloudCb(Sensor& sensor, const PointCloud2ConstPtr& msg) {
+  if (!measuring_) return;
+  sensor.cloud_latency.Record((ros::Time::now() - msg->header.stamp).toNSec());
+  ++sensor.clouds;
+}
+
+void ReplayReport::ImageCb(Sensor& sensor, const ImageConstPtr& msg) {
+  if (!measuring_) return;
+  sensor.image_latency.Record((ros::Time::now() - msg->header.stamp).toNSec());
+  ++sensor.images;
+}
+
+void ReplayReport::DiagnosticsCb(
+    const diagnostic_msgs::DiagnosticArrayConstPtr& msg) {
+  if (!measuring_) return;
+
+  std::lock_guard<std::mutex> lock(diag_mutex_);
+  for (const auto& status : msg->status) {
+    for (auto& sensor : sensors_) {
+      if (IsTask(status.name, sensor->name + "/decoder latency")) {
+        // See Decoder::LatencyDiagnostic
+        for (const auto& kv : status.values) {
+          size_t count;
+          double mean, p50, p90, p99, max;
+          if (std::sscanf(kv.value.c_str(),
+                          "n %zu, mean %lf, p50 %lf, p90 %lf, p99 %lf, "
+                          "max %lf",
+                          &count, &mean, &p50, &p90, &p99, &max) != 6 ||
+              count == 0) {
+            continue;
+          }
+          auto& stage = sensor->stages[kv.key];
+          stage.count += count;
+          stage.sum_us += mean * count;
+          stage.p50_us = std::max(stage.p50_us, p50);
+          stage.p90_us = std::max(stage.p90_us, p90);
+          stage.p99_us = std::max(stage.p99_us, p99);
+          stage.max_us = std::max(stage.max_us, max);
+        }
+      } else if (IsTask(status.name, sensor->name + "/decoder")) {
+        for (const auto& kv : status.values) {
+          for (const auto* counter : kDecoderCounters) {
+            if (kv.key == counter) {
+              sensor->counters[kv.key] += std::atof(kv.value.c_str());
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+void ReplayReport::Start() {
+  // Drop everything recorded so far
+  for (auto& sensor : sensors_) {
+    sensor->cloud_latency.Drain();
+    sensor->image_latency.Drain();
+  }
+  start_time_ = Clock::now();
+  start_cpu_ = ProcessCpuSeconds();
+  measuring_ = true;
+  ROS_INFO("Measuring");
+}
+
+void ReplayReport::Finish() {
+  measuring_ = false;
+  const auto seconds =
+      std::chrono::duration<double>(Clock::now() - start_time_).count();
+  const auto cpu_seconds = ProcessCpuSeconds() - start_cpu_;
+
+  std::lock_guard<std::mutex> lock(diag_mutex_);
+  const bool ok = WriteReport(seconds, cpu_seconds);
+  ROS_INFO("Wrote %s, %s", output_.c_str(), ok ? "ok" : "FAILED limits");
+  ros::shutdown();
+}
+
+bool ReplayReport::WriteReport(double seconds, double cpu_seconds) const {
+  std::ofstream out(output_);
+  out << std::fixed << std::setprecision(1);
+
+  const auto latency = [&out](LatencyHistogram::Summary s) {
+    out << "{\"count\": " << s.count << ", \"mean_us\": " << s.mean_us
+        << ", \"p50_us\": " << s.p50_us << ", \"p90_us\": " << s.p90_us
+        << ", \"p99_us\": " << s.p99_us << ", \"max_us\": " << s.max_us
+        << "}";
+  };
+
+  const auto cpu_percent = cpu_seconds / seconds * 100;
+  out << "{\n  \"pcap\": \"" << pcap_ << "\",\n  \"pcap_rate\": " << pcap_rate_
+      << ",\n  \"num_sensors\": " << sensors_.size()
+      << ",\n  \"seconds\": " << seconds
+      << ",\n  \"cpu_percent\": " << cpu_percent
+      << ",\n  \"cpu_percent_per_sensor\": " << cpu_percent / sensors_.size()
+      << ",\n  \"sensors\": {";
+
+  bool ok = true;
+  for (size_t i = 0; i < sensors_.size(); ++i) {
+    auto& sensor = *sensors_[i];
+    const auto cloud = sensor.cloud_latency.Drain();
+    const auto image = sensor.image_latency.Drain();
+
+    out << (i > 0 ? "," : "") << "\n    \"" << sensor.name << "\": {";
+    out << "\n      \"cloud_rate_hz\": " << sensor.clouds / seconds;
+    out << ",\n      \"image_rate_hz\": " << sensor.images / seconds;
+    out << ",\n      \"cloud_latency\": ";
+    latency(cloud);
+    out << ",\n      \"image_latency\": ";
+    latency(image);
+
+    // Decoder stages are in us already, so are their percentiles
+    for (const auto& kv : sensor.stages) {
+      const auto& stage = kv.second;
+      LatencyHistogram::Summary s;
+      s.count = stage.count;
+      s.mean_us = stage.sum_us / stage.count;
+      s.p50_us = stage.p50_us;
+      s.p90_us = stage.p90_us;
+      s.p99_us = stage.p99_us;
+      s.max_us = stage.max_us;
+      out << ",\n      \"" << kv.first << "\": ";
+      latency(s);
+    }
+
+    double drops = 0;
+    for (const auto* counter : kDecoderCounters) {
+      const auto it = sensor.counters.find(counter);
+      const auto value = it == sensor.counters.end() ? 0.0 : it->second;
+      out << ",\n      \"" << counter << "\": " << value;
+    }
+    for (const auto* counter : {"Lost packets", "Late packets"}) {
+      const auto it = sensor.counters.find(counter);
+      if (it != sensor.counters.end()) drops += it->second;
+    }
+    out << "\n    }";
+
+    if (max_latency_us_ > 0 &&
+        (cloud.count == 0 || cloud.p99_us > max_latency_us_)) {
+      ok = false;
+    }
+    if (max_drops_ >= 0 && drops > max_drops_) ok = false;
+  }
+
+  out << "\n  },\n  \"ok\": " << (ok ? "true" : "false") << "\n}\n";
+  return ok;
+}
+
+}  // namespace velodyne_puck
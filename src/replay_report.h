@@ -0,0 +1,88 @@
+#pragma once
+
+#include "latency.h"
+
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace velodyne_puck {
+
+/// End to end measurement of a replay through driver and decoder. Meant to
+/// be loaded into the nodelet manager of both, so that clouds and images
+/// arrive like at any consumer in the same process and the cpu time of the
+/// process is that of the whole pipeline. After warmup it measures for
+/// duration seconds, then writes a json report to output and shuts down.
+class ReplayReport {
+ public:
+  /// Subscribes nh/<decoder>/<sensor>/{cloud, image} and /diagnostics
+  ReplayReport(const ros::NodeHandle& nh, const ros::NodeHandle& pnh);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  /// Decoder latency of one stage over several diagnostic periods, which
+  /// only report percentiles per period. Percentiles are those of the worst
+  /// period.
+  struct Stage {
+    size_t count{0};
+    double sum_us{0};
+    double p50_us{0};
+    double p90_us{0};
+    double p99_us{0};
+    double max_us{0};
+  };
+
+  struct Sensor {
+    std::string name;
+    ros::Subscriber cloud_sub;
+    ros::Subscriber image_sub;
+
+    // Header stamp to receive, i.e. from the first packet of a sweep on
+    LatencyHistogram cloud_latency;
+    LatencyHistogram image_latency;
+    std::atomic<size_t> clouds{0};
+    std::atomic<size_t> images{0};
+
+    // From diagnostics, guarded by diag_mutex_
+    std::map<std::string, Stage> stages;
+    std::map<std::string, double> counters;
+  };
+
+  void CloudCb(Sensor& sensor, const sensor_msgs::PointCloud2ConstPtr& msg);
+  void ImageCb(Sensor& sensor, const sensor_msgs::ImageConstPtr& msg);
+  void DiagnosticsCb(const diagnostic_msgs::DiagnosticArrayConstPtr& msg);
+
+  void Start();
+  void Finish();
+  /// Report as json, whether it is within max_latency_us_ and max_drops_
+  bool WriteReport(double seconds, double cpu_seconds) const;
+
+  ros::NodeHandle nh_;
+  ros::NodeHandle pnh_;
+  std::vector<std::unique_ptr<Sensor>> sensors_;
+  ros::Subscriber diag_sub_;
+  ros::WallTimer start_timer_, finish_timer_;
+
+  std::string output_;
+  std::string pcap_;
+  double pcap_rate_{1.0};
+  double max_latency_us_{0};  // p99 of the cloud latency, 0 is no limit
+  int max_drops_{-1};         // lost and late packets, -1 is no limit
+
+  std::mutex diag_mutex_;
+  std::atomic_bool measuring_{false};
+  Clock::time_point start_time_;
+  double start_cpu_{0};
+};
+
+}  // namespace velodyne_puck
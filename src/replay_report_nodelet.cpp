@@ -0,0 +1,25 @@
+#include "replay_report.h"
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include <memory>
+
+namespace velodyne_puck {
+
+/// ReplayReport in the manager of the driver and decoder nodelets, clouds and
+/// images are received by pointer and the process cpu time covers all of
+/// them
+class ReplayReportNodelet : public nodelet::Nodelet {
+ private:
+  void onInit() override {
+    report_.reset(
+        new ReplayReport(getMTNodeHandle(), getMTPrivateNodeHandle()));
+  }
+
+  std::unique_ptr<ReplayReport> report_;
+};
+
+}  // namespace velodyne_puck
+
+PLUGINLIB_EXPORT_CLASS(velodyne_puck::ReplayReportNodelet, nodelet::Nodelet)
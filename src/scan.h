@@ -0,0 +1,94 @@
+#pragma once
+
+#include "constants.h"
+#include "model.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace velodyne_puck {
+
+/// Structure-of-arrays storage for one sweep. Range, intensity and azimuth are
+/// separate contiguous rows x stride planes in row-major order, row 0 is the
+/// top laser, of which the first cols columns are used. Nominal azimuth and
+/// time are stored per column. A dual return scan has a second layer of
+/// range and intensity, which shares azimuth and time with the first.
+struct ScanBuffer {
+  ScanBuffer() = default;
+  explicit ScanBuffer(int width, int num_layers = 1) {
+    Reset(width, num_layers);
+  }
+
+  /// Resize to width columns of num_layers and invalidate all data, only
+  /// allocates if width grows
+  void Reset(int width, int num_layers = 1) {
+    cols = stride = width;
+    layers = num_layers;
+    const auto size = static_cast<size_t>(rows) * stride;
+    range.resize(size);
+    intensity.resize(size);
+    azimuth.resize(size);
+    azimuths.resize(cols);
+    timestamps.resize(cols);
+
+    std::fill(range.begin(), range.end(), kNaNF);
+    std::fill(intensity.begin(), intensity.end(), kNaNF);
+    std::fill(azimuth.begin(), azimuth.end(), kNaNF);
+    std::fill(azimuths.begin(), azimuths.end(), kNaND);
+    std::fill(timestamps.begin(), timestamps.end(), 0);
+    num_valid = 0;
+
+    if (layers > 1) {
+      range2.resize(size);
+      intensity2.resize(size);
+      std::fill(range2.begin(), range2.end(), kNaNF);
+      std::fill(intensity2.begin(), intensity2.end(), kNaNF);
+    }
+    num_valid2 = 0;
+  }
+
+  /// Keep only the first width columns, e.g. when a sweep is cut early
+  void Shrink(int width) { cols = std::min(cols, width); }
+
+  /// Number of measurements in the used columns
+  size_t size() const { return static_cast<size_t>(rows) * cols; }
+
+  size_t Index(int r, int c) const {
+    return static_cast<size_t>(r) * stride + c;
+  }
+
+  float* RangeRow(int r) { return &range[Index(r, 0)]; }
+  float* IntensityRow(int r) { return &intensity[Index(r, 0)]; }
+  float* AzimuthRow(int r) { return &azimuth[Index(r, 0)]; }
+  const float* RangeRow(int r) const { return &range[Index(r, 0)]; }
+  const float* IntensityRow(int r) const { return &intensity[Index(r, 0)]; }
+  const float* AzimuthRow(int r) const { return &azimuth[Index(r, 0)]; }
+  const float* Range2Row(int r) const { return &range2[Index(r, 0)]; }
+  const float* Intensity2Row(int r) const { return &intensity2[Index(r, 0)]; }
+
+  int rows{kFiringsPerSequence};
+  int cols{0};
+  int stride{0};  // allocated columns
+  int layers{1};  // 2 if range2 and intensity2 are used
+  Model model{Model::kVlp16};  // of the sensor, decides the beam geometry
+  /// Set by the decoder whenever it starts a sweep over, caches of anything
+  /// derived from the scan are only good for the same sweep_id
+  uint64_t sweep_id{0};
+
+  std::vector<float> range;      // [m] strongest or only return
+  std::vector<float> intensity;  // reflectivity
+  std::vector<float> azimuth;    // [rad] of each firing
+
+  std::vector<double> azimuths;      // [rad] nominal azimuth of each column
+  std::vector<uint64_t> timestamps;  // [ns] time of each column
+
+  // Second layer of a dual return scan
+  std::vector<float> range2;      // [m] last return
+  std::vector<float> intensity2;  // reflectivity of the last return
+
+  /// Number of non-NaN ranges of each layer, counted while decoding
+  int num_valid{0};
+  int num_valid2{0};
+};
+
+}  // namespace velodyne_puck
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace velodyne_puck {
+
+/// Lock free ring of preallocated slots between exactly one producer and one
+/// consumer thread. Slots are written and read in place, in runs of
+/// contiguous slots so that a run can be filled by one recvmmsg() call.
+/// Neither side ever blocks or allocates.
+template <typename T>
+class SpscRing {
+ public:
+  /// capacity is rounded up to a power of two
+  explicit SpscRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size *= 2;
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  size_t capacity() const { return slots_.size(); }
+
+  /// Producer only. Up to max free slots from slots on, fewer at the end of
+  /// the buffer, 0 if the ring is full.
+  size_t BeginWrite(T*& slots, size_t max) {
+    const auto head = head_.load(std::memory_order_relaxed);
+    const auto tail = tail_.load(std::memory_order_acquire);
+    const auto index = head & mask_;
+    slots = &slots_[index];
+    return std::min({max, capacity() - (head - tail), capacity() - index});
+  }
+
+  /// Producer only. Hands the first n slots of the last BeginWrite() to the
+  /// consumer.
+  void EndWrite(size_t n) {
+    head_.store(head_.load(std::memory_order_relaxed) + n,
+                std::memory_order_release);
+  }
+
+  /// Consumer only. Up to max written slots from slots on, fewer at the end
+  /// of the buffer, 0 if the ring is empty.
+  size_t BeginRead(T*& slots, size_t max) {
+    const auto tail = tail_.load(std::memory_order_relaxed);
+    const auto head = head_.load(std::memory_order_acquire);
+    const auto index = tail & mask_;
+    slots = &slots_[index];
+    return std::min({max, head - tail, capacity() - index});
+  }
+
+  /// Consumer only. Gives the first n slots of the last BeginRead() back to
+  /// the producer.
+  void EndRead(size_t n) {
+    tail_.store(tail_.load(std::memory_order_relaxed) + n,
+                std::memory_order_release);
+  }
+
+ private:
+  std::vector<T> slots_;
+  size_t mask_{0};
+
+  // Ever increasing, a cache line apart so the two sides do not share one.
+  // Padded rather than aligned, which new only honors from C++17 on.
+  std::atomic<size_t> head_{0};  // next slot to write
+  char padding_[64];
+  std::atomic<size_t> tail_{0};  // next slot to read
+};
+
+}  // namespace velodyne_puck
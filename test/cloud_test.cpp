@@ -0,0 +1,220 @@
+#include "decoder.h"
+#include "packet_decoder.h"
+#include "packet_generator.h"
+
+#include <gtest/gtest.h>
+#include <boost/make_shared.hpp>
+#include <sensor_msgs/image_encodings.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace velodyne_puck {
+namespace {
+
+/// Decodes into two alternating buffers, each with its own trig cache like
+/// the sweeps of Decoder. Sector clouds fill the cache, the cloud of each
+/// finished sweep is converted once with and once without it.
+struct CloudCollector {
+  CloudCollector(const DecodeOptions& decode_options, bool precise)
+      : decoder(
+            [this](ScanBuffer& scan) {
+              FinishSweep(scan);
+              return &scan == &buffers[0] ? &buffers[1] : &buffers[0];
+            },
+            [this](const ScanBuffer& scan, int col_begin, int col_end) {
+              auto options = Options();
+              options.trig = &Trig(scan);
+              options.fill_trig = true;
+              sensor_msgs::PointCloud2 sector;
+              ToCloud(scan, col_begin, col_end, beams, options, sector);
+              ++num_sectors;
+            }) {
+    cloud_options.precise = precise;
+    decoder.Reset(&buffers[0], decode_options);
+  }
+
+  CloudOptions Options() const { return cloud_options; }
+  AzimuthTrig& Trig(const ScanBuffer& scan) {
+    return trigs[&scan == &buffers[0] ? 0 : 1];
+  }
+
+  void FinishSweep(const ScanBuffer& scan) {
+    auto options = Options();
+    options.trig = &Trig(scan);
+    sensor_msgs::PointCloud2 cached, fresh;
+    ToCloud(scan, beams, options, cached);
+    ToCloud(scan, beams, Options(), fresh);
+    EXPECT_GT(Trig(scan).cols, 0);
+    EXPECT_EQ(cached.data, fresh.data);
+    ++num_sweeps;
+  }
+
+  BeamTable beams;
+  CloudOptions cloud_options;
+  ScanBuffer buffers[2];
+  AzimuthTrig trigs[2];
+  int num_sectors{0};
+  int num_sweeps{0};
+  PacketDecoder decoder;
+};
+
+TEST(ToCloudTest, SectorTrigIsDroppedWhenTheSweepStartsOver) {
+  for (const bool precise : {true, false}) {
+    SCOPED_TRACE(precise);
+    DecodeOptions options;
+    options.sector_angle = 30;
+    CloudCollector collector(options, precise);
+
+    // Sectors of the half revolution before the first cut fill the trig of
+    // columns the first full sweep then decodes at other azimuths
+    PacketGenerator generator(600);
+    generator.SetAzimuth(180);
+    const int num_packets = generator.PacketsPerRevolutions(2.75);
+    for (int i = 0; i < num_packets; ++i) {
+      const auto packet = generator.Next();
+      ASSERT_EQ(collector.decoder.Decode(
+                    reinterpret_cast<const uint8_t*>(&packet), sizeof(packet),
+                    0),
+                DecodeResult::kOk);
+    }
+
+    EXPECT_EQ(collector.num_sweeps, 2);
+    EXPECT_GT(collector.num_sectors, 24);
+  }
+}
+
+/// Laser corrections with every offset set
+std::vector<LaserCorrection> TestCorrections() {
+  std::vector<LaserCorrection> lasers(kFiringsPerSequence);
+  for (int i = 0; i < kFiringsPerSequence; ++i) {
+    auto& laser = lasers[i];
+    laser.laser_id = i;
+    laser.vert_correction = deg2rad((i % 2 ? 1 : -15) + (i / 2) * 2.1);
+    laser.rot_correction = deg2rad(0.2 * (i - 8));
+    laser.dist_correction = 0.05 * (i - 8);
+    laser.vert_offset_correction = 0.01 * i;
+    laser.horiz_offset_correction = 0.02 * (i % 4) - 0.03;
+  }
+  return lasers;
+}
+
+/// First full sweep of rpm with the geometry of beams
+ScanBuffer DecodeSweep(int rpm, const BeamTable& beams) {
+  ScanBuffer buffer, sweep;
+  bool done = false;
+  PacketDecoder decoder([&](ScanBuffer& scan) {
+    if (!done) sweep = scan;
+    done = true;
+    return &scan;
+  });
+  DecodeOptions options;
+  std::copy(std::begin(beams.distance_bias), std::end(beams.distance_bias),
+            std::begin(options.distance_bias));
+  decoder.Reset(&buffer, options);
+
+  PacketGenerator generator(rpm);
+  const int num_packets = generator.PacketsPerRevolutions(2.5);
+  for (int i = 0; i < num_packets; ++i) {
+    const auto packet = generator.Next();
+    decoder.Decode(reinterpret_cast<const uint8_t*>(&packet), sizeof(packet),
+                   0);
+  }
+  return sweep;
+}
+
+/// Camera info of the whole sweep as the decoder publishes it
+sensor_msgs::CameraInfo SweepCameraInfo(const ScanBuffer& scan,
+                                        const BeamTable& beams) {
+  sensor_msgs::CameraInfo cinfo;
+  cinfo.D = beams.elevations;
+  cinfo.D.insert(cinfo.D.end(), scan.azimuths.begin(),
+                 scan.azimuths.begin() + scan.cols);
+  return cinfo;
+}
+
+/// The interleaved (range, intensity, azimuth) image of the decoder
+sensor_msgs::ImageConstPtr SweepImage(const ScanBuffer& scan) {
+  auto image = boost::make_shared<sensor_msgs::Image>();
+  image->height = scan.rows;
+  image->width = scan.cols;
+  image->encoding = sensor_msgs::image_encodings::TYPE_32FC3;
+  image->step = scan.cols * 3 * sizeof(float);
+  image->data.resize(image->step * scan.rows);
+  auto* out = reinterpret_cast<float*>(image->data.data());
+  for (int r = 0; r < scan.rows; ++r) {
+    for (int c = 0; c < scan.cols; ++c, out += 3) {
+      const auto i = scan.Index(r, c);
+      out[0] = scan.range[i];
+      out[1] = scan.intensity[i];
+      out[2] = scan.azimuth[i];
+    }
+  }
+  return image;
+}
+
+/// Largest distance between the points of an organized cloud and those
+/// rebuilt from an image, relative to the range of the point
+double MaxRelativeError(const sensor_msgs::PointCloud2& expected,
+                        const CloudT& actual) {
+  EXPECT_EQ(actual.size(), expected.width * expected.height);
+  double max_error = 0;
+  for (size_t i = 0; i < actual.size(); ++i) {
+    float xyz[3];
+    std::memcpy(xyz, &expected.data[i * expected.point_step], sizeof(xyz));
+    const auto& p = actual.points[i];
+    if (std::isnan(xyz[0])) {
+      EXPECT_TRUE(std::isnan(p.x));
+      continue;
+    }
+    const auto error =
+        std::hypot(std::hypot(p.x - xyz[0], p.y - xyz[1]), p.z - xyz[2]);
+    const auto range = std::hypot(std::hypot(xyz[0], xyz[1]), xyz[2]);
+    max_error = std::max(max_error, static_cast<double>(error / range));
+  }
+  return max_error;
+}
+
+TEST(ToCloudTest, ImagesRebuildTheCalibratedCloud) {
+  const BeamTable beams(TestCorrections());
+  const auto scan = DecodeSweep(600, beams);
+  ASSERT_GT(scan.cols, 0);
+
+  CloudOptions options;
+  sensor_msgs::PointCloud2 cloud;
+  ToCloud(scan, beams, options, cloud);
+
+  const auto cinfo = SweepCameraInfo(scan, beams);
+  const auto image = SweepImage(scan);
+  auto packed = boost::make_shared<sensor_msgs::Image>();
+  ToPacked(scan, 0, scan.cols, std_msgs::Header(), *packed);
+
+  // Same azimuths as the decoder
+  EXPECT_LT(MaxRelativeError(cloud, ToCloud(image, cinfo, beams, true)),
+            1e-6);
+  // Firing azimuths are interpolated from the column azimuths in D, steps
+  // between which vary by the 0.01 deg of raw azimuths
+  EXPECT_LT(MaxRelativeError(cloud, ToCloud(packed, cinfo, beams, true)),
+            2e-4);
+  // Elevations alone are far off
+  EXPECT_GT(MaxRelativeError(cloud, ToCloud(image, cinfo, true)), 1e-3);
+}
+
+TEST(ToCloudTest, ElevationsOnlyMatchANominalCloud) {
+  const BeamTable beams(Model::kPuckHiRes);
+  const auto scan = DecodeSweep(600, beams);
+  ASSERT_GT(scan.cols, 0);
+
+  CloudOptions options;
+  sensor_msgs::PointCloud2 cloud;
+  ToCloud(scan, beams, options, cloud);
+  EXPECT_LT(MaxRelativeError(cloud, ToCloud(SweepImage(scan),
+                                            SweepCameraInfo(scan, beams),
+                                            true)),
+            1e-6);
+}
+
+}  // namespace
+}  // namespace velodyne_puck
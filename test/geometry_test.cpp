@@ -0,0 +1,137 @@
+#include "calibration.h"
+#include "decode_kernel.h"
+#include "deskew.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace velodyne_puck {
+namespace {
+
+TEST(BeamTableTest, NominalElevations) {
+  for (const auto& info : kModels) {
+    SCOPED_TRACE(info.name);
+    const BeamTable beams(info.model);
+    ASSERT_EQ(beams.elevations.size(), static_cast<size_t>(info.lasers));
+    EXPECT_FLOAT_EQ(beams.elevations.front(), info.max_elevation);
+    EXPECT_FLOAT_EQ(beams.elevations.back(), info.min_elevation);
+    for (int r = 0; r < info.lasers; ++r) {
+      EXPECT_FLOAT_EQ(beams.sin_elevation[r], std::sin(beams.elevations[r]));
+      EXPECT_FLOAT_EQ(beams.distance_bias[r], 0);
+      EXPECT_FLOAT_EQ(beams.azimuth_offset[r], 0);
+    }
+  }
+}
+
+TEST(BeamTableTest, CorrectionAtRowOfLaser) {
+  LaserCorrection laser;
+  laser.laser_id = 3;
+  laser.vert_correction = deg2rad(2.0);
+  laser.rot_correction = deg2rad(1.5);
+  laser.dist_correction = 0.02;
+  const BeamTable nominal;
+  const BeamTable beams(std::vector<LaserCorrection>{laser});
+
+  const int row = LaserId2Row(laser.laser_id);
+  ASSERT_EQ(kRow2LaserId[row], laser.laser_id);
+  EXPECT_NEAR(beams.elevations[row], laser.vert_correction, 1e-6);
+  EXPECT_FLOAT_EQ(beams.distance_bias[row], laser.dist_correction);
+  // Subtracted from the azimuth and wrapped into [0, 2pi)
+  EXPECT_NEAR(beams.azimuth_offset[row], 2 * M_PI - laser.rot_correction,
+              1e-5);
+  EXPECT_LT(beams.azimuth_offset[row], 2 * M_PI);
+
+  // Laser ids without a correction keep their nominal geometry
+  for (int r = 0; r < kFiringsPerSequence; ++r) {
+    if (r == row) continue;
+    EXPECT_FLOAT_EQ(beams.sin_elevation[r], nominal.sin_elevation[r]);
+    EXPECT_FLOAT_EQ(beams.azimuth_offset[r], nominal.azimuth_offset[r]);
+  }
+}
+
+TEST(DeskewTest, IdentityMotion) {
+  const std::vector<uint64_t> timestamps = {0, 1000, 2000, 3000};
+  ColumnTransforms transforms;
+  InterpolateColumns(Pose(), Pose(), timestamps.data(), 0, 4, transforms);
+  ASSERT_GE(transforms.size(), 4u);
+  for (int c = 0; c < 4; ++c) {
+    for (int i = 0; i < 9; ++i) {
+      EXPECT_FLOAT_EQ(transforms.r[i][c], i % 4 == 0 ? 1 : 0);
+    }
+    for (const auto& t : transforms.t) EXPECT_FLOAT_EQ(t[c], 0);
+  }
+}
+
+TEST(DeskewTest, ConstantVelocityTranslation) {
+  const std::vector<uint64_t> timestamps = {100, 200, 300};
+  Pose end;
+  end.x = 1;
+  ColumnTransforms transforms;
+  InterpolateColumns(Pose(), end, timestamps.data(), 0, 3, transforms);
+  EXPECT_FLOAT_EQ(transforms.t[0][0], 0);
+  EXPECT_FLOAT_EQ(transforms.t[0][1], 0.5);
+  EXPECT_FLOAT_EQ(transforms.t[0][2], 1);
+  EXPECT_FLOAT_EQ(transforms.t[1][1], 0);
+
+  // Stamps outside [start, end] do not extrapolate
+  const std::vector<uint64_t> unordered = {200, 100, 400, 300};
+  InterpolateColumns(Pose(), end, unordered.data(), 0, 4, transforms);
+  EXPECT_FLOAT_EQ(transforms.t[0][1], 0);
+  EXPECT_FLOAT_EQ(transforms.t[0][2], 1);
+}
+
+TEST(DeskewTest, ApplyMatchesReference) {
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> value(-10, 10);
+  const auto nan = std::numeric_limits<float>::quiet_NaN();
+
+  // Lengths around the vector width, from a column that is not aligned
+  for (const int cols : {0, 1, 7, 8, 9, 17, 1809}) {
+    SCOPED_TRACE(cols);
+    const int col_begin = 3;
+    ColumnTransforms transforms;
+    transforms.resize(col_begin + cols);
+    for (auto& plane : transforms.r) {
+      for (auto& v : plane) v = value(rng);
+    }
+    for (auto& plane : transforms.t) {
+      for (auto& v : plane) v = value(rng);
+    }
+
+    std::vector<float> x(cols), y(cols), z(cols);
+    for (int i = 0; i < cols; ++i) {
+      x[i] = i % 5 == 0 ? nan : value(rng);
+      y[i] = value(rng);
+      z[i] = value(rng);
+    }
+    auto px = x, py = y, pz = z;
+    ApplyColumnTransforms(transforms, col_begin, col_begin + cols, px.data(),
+                          py.data(), pz.data());
+
+    for (int i = 0; i < cols; ++i) {
+      const int c = col_begin + i;
+      const auto& r = transforms.r;
+      const auto& t = transforms.t;
+      const float ex =
+          r[0][c] * x[i] + r[1][c] * y[i] + r[2][c] * z[i] + t[0][c];
+      const float ey =
+          r[3][c] * x[i] + r[4][c] * y[i] + r[5][c] * z[i] + t[1][c];
+      const float ez =
+          r[6][c] * x[i] + r[7][c] * y[i] + r[8][c] * z[i] + t[2][c];
+      if (std::isnan(x[i])) {
+        EXPECT_TRUE(std::isnan(px[i]));
+        continue;
+      }
+      EXPECT_NEAR(px[i], ex, 1e-4);
+      EXPECT_NEAR(py[i], ey, 1e-4);
+      EXPECT_NEAR(pz[i], ez, 1e-4);
+    }
+  }
+}
+
+}  // namespace
+}  // namespace velodyne_puck
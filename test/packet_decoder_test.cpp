@@ -0,0 +1,213 @@
+#include "packet_decoder.h"
+#include "packet_generator.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+namespace velodyne_puck {
+namespace {
+
+/// Decodes into two alternating buffers and keeps a copy of every sweep
+struct SweepCollector {
+  SweepCollector()
+      : decoder([this](ScanBuffer& scan) {
+          sweeps.push_back(scan);
+          return &scan == &buffers[0] ? &buffers[1] : &buffers[0];
+        }) {
+    decoder.Reset(&buffers[0], DecodeOptions());
+  }
+
+  void Decode(const Packet& packet, uint64_t time = 0) {
+    ASSERT_EQ(decoder.Decode(reinterpret_cast<const uint8_t*>(&packet),
+                             sizeof(packet), time),
+              DecodeResult::kOk);
+  }
+
+  ScanBuffer buffers[2];
+  std::vector<ScanBuffer> sweeps;
+  PacketDecoder decoder;
+};
+
+int CountFinite(const ScanBuffer& scan, const std::vector<float>& plane) {
+  int n = 0;
+  for (int r = 0; r < scan.rows; ++r) {
+    for (int c = 0; c < scan.cols; ++c) {
+      n += !std::isnan(plane[scan.Index(r, c)]);
+    }
+  }
+  return n;
+}
+
+TEST(PacketDecoderTest, FullSweepsCoverOneRevolution) {
+  for (const int rpm : {300, 600, 1200}) {
+    SCOPED_TRACE(rpm);
+    SweepCollector collector;
+    PacketGenerator generator(rpm);
+    const int num_packets = generator.PacketsPerRevolutions(4.5);
+    for (int i = 0; i < num_packets; ++i) collector.Decode(generator.Next());
+
+    // The revolution before the first cut is dropped
+    ASSERT_EQ(collector.sweeps.size(), 3u);
+    // Raw azimuths are truncated to 0.01 deg
+    EXPECT_NEAR(collector.decoder.rpm(), rpm, 1);
+    const auto columns = 360.0 / AzimuthResolutionDegree(rpm);
+    for (const auto& sweep : collector.sweeps) {
+      EXPECT_NEAR(sweep.cols, columns, 1.0);
+      EXPECT_LE(sweep.cols, SweepColumns(rpm));
+      EXPECT_EQ(sweep.rows, kFiringsPerSequence);
+    }
+  }
+}
+
+TEST(PacketDecoderTest, NumValidCountsFiniteRanges) {
+  for (const auto return_mode : {kReturnModeStrongest, kReturnModeDual}) {
+    SCOPED_TRACE(static_cast<int>(return_mode));
+    SweepCollector collector;
+    PacketGenerator generator(600, return_mode);
+    const int num_packets = generator.PacketsPerRevolutions(3.5);
+    for (int i = 0; i < num_packets; ++i) collector.Decode(generator.Next());
+
+    ASSERT_EQ(collector.sweeps.size(), 2u);
+    for (const auto& sweep : collector.sweeps) {
+      EXPECT_GT(sweep.num_valid, 0);
+      EXPECT_LT(sweep.num_valid, static_cast<int>(sweep.size()));
+      EXPECT_EQ(sweep.num_valid, CountFinite(sweep, sweep.range));
+      if (return_mode == kReturnModeDual) {
+        ASSERT_EQ(sweep.layers, 2);
+        EXPECT_EQ(sweep.num_valid2, CountFinite(sweep, sweep.range2));
+      } else {
+        EXPECT_EQ(sweep.layers, 1);
+        EXPECT_EQ(sweep.num_valid2, 0);
+      }
+    }
+  }
+}
+
+TEST(PacketDecoderTest, LostPacketsLeaveNaNColumns) {
+  SweepCollector collector;
+  PacketGenerator generator(600);
+  const int num_packets = generator.PacketsPerRevolutions(3.5);
+  const int lost_begin = generator.PacketsPerRevolutions(2.5);
+  const int num_lost = 3;
+  for (int i = 0; i < num_packets; ++i) {
+    const auto packet = generator.Next();
+    if (i < lost_begin || i >= lost_begin + num_lost) collector.Decode(packet);
+  }
+
+  ASSERT_EQ(collector.sweeps.size(), 2u);
+  const auto& stats = collector.decoder.stats();
+  EXPECT_EQ(stats.lost_packets, static_cast<size_t>(num_lost));
+  EXPECT_EQ(stats.filled_columns,
+            static_cast<size_t>(num_lost * kSequencesPerPacket));
+
+  // Columns stay at their azimuth, so the sweep is as wide as without loss
+  const auto& full = collector.sweeps[0];
+  const auto& gap = collector.sweeps[1];
+  EXPECT_NEAR(gap.cols, full.cols, 1);
+  int nan_cols = 0;
+  for (int c = 0; c < gap.cols; ++c) {
+    bool all_nan = true;
+    for (int r = 0; r < gap.rows; ++r) {
+      all_nan = all_nan && std::isnan(gap.range[gap.Index(r, c)]);
+    }
+    nan_cols += all_nan;
+  }
+  EXPECT_GE(nan_cols, num_lost * kSequencesPerPacket);
+  EXPECT_EQ(gap.num_valid, CountFinite(gap, gap.range));
+}
+
+TEST(PacketDecoderTest, StampWrapAtTopOfHourIsNoLoss) {
+  SweepCollector collector;
+  PacketGenerator generator(600, kReturnModeStrongest, 34, 3600000000u - 5000);
+  for (int i = 0; i < 20; ++i) collector.Decode(generator.Next());
+  EXPECT_EQ(collector.decoder.stats().lost_packets, 0u);
+}
+
+TEST(PacketDecoderTest, ModelFromProductId) {
+  SweepCollector collector;
+  PacketGenerator hi_res(600, kReturnModeStrongest, 36);
+  const int num_packets = hi_res.PacketsPerRevolutions(2.5);
+  for (int i = 0; i < num_packets; ++i) collector.Decode(hi_res.Next());
+  EXPECT_EQ(collector.decoder.model(), Model::kPuckHiRes);
+  ASSERT_EQ(collector.sweeps.size(), 1u);
+  EXPECT_EQ(collector.sweeps[0].model, Model::kPuckHiRes);
+
+  PacketGenerator unknown(600, kReturnModeStrongest, 40);
+  const auto packet = unknown.Next();
+  EXPECT_EQ(collector.decoder.Decode(reinterpret_cast<const uint8_t*>(&packet),
+                                     sizeof(packet), 0),
+            DecodeResult::kInvalidProductId);
+}
+
+TEST(DecodeKernelTest, LimitsIncludeDistanceBias) {
+  float distance_bias[kFiringsPerSequence] = {};
+  distance_bias[0] = 1;   // row 0, laser 15
+  distance_bias[1] = -1;  // row 1, laser 13
+  const RangeLimits limits(0.5f, 10.0f, distance_bias);
+
+  // Raw 9.5 m, 0 (no return) and 0.2 m for every laser
+  uint8_t points[kFiringsPerSequence * kPointBytes + 1] = {};
+  const auto set = [&points](int lid, uint16_t distance) {
+    points[lid * kPointBytes] = distance & 0xff;
+    points[lid * kPointBytes + 1] = distance >> 8;
+  };
+  for (int lid = 0; lid < kFiringsPerSequence; ++lid) set(lid, 4750);
+  set(kRow2LaserId[2], 0);
+  set(kRow2LaserId[3], 100);
+
+  DecodedSequence out;
+  const int num_valid = DecodeSequenceScalar(points, 0, 0, limits, out);
+  EXPECT_TRUE(std::isnan(out.range[0]));  // 10.5 m corrected
+  EXPECT_FLOAT_EQ(out.range[1], 9.5);     // 8.5 m corrected
+  EXPECT_TRUE(std::isnan(out.range[2]));
+  EXPECT_TRUE(std::isnan(out.range[3]));
+  EXPECT_EQ(num_valid, kFiringsPerSequence - 3);
+
+  // No return stays invalid however large the bias
+  distance_bias[2] = 2;
+  const RangeLimits biased(0.5f, 10.0f, distance_bias);
+  DecodeSequenceScalar(points, 0, 0, biased, out);
+  EXPECT_TRUE(std::isnan(out.range[2]));
+}
+
+TEST(DecodeKernelTest, MatchesScalar) {
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::uniform_real_distribution<float> bias(-1, 1);
+  const auto decode = GetDecodeSequence();
+  SCOPED_TRACE(GetDecodeSequenceName());
+
+  // Limits differ by row
+  float distance_bias[kFiringsPerSequence];
+  for (auto& b : distance_bias) b = bias(rng);
+  const RangeLimits limits(0.5f, 100.0f, distance_bias);
+
+  for (int i = 0; i < 1000; ++i) {
+    // One byte more than the sequence, which vector kernels may read
+    uint8_t points[kFiringsPerSequence * kPointBytes + 1];
+    for (auto& b : points) b = byte(rng);
+    const float azimuth = i * 0.01f;
+    const float gap = 0.003f;
+
+    DecodedSequence expected, actual;
+    const int expected_valid =
+        DecodeSequenceScalar(points, azimuth, gap, limits, expected);
+    const int actual_valid = decode(points, azimuth, gap, limits, actual);
+    ASSERT_EQ(actual_valid, expected_valid);
+    for (int r = 0; r < kFiringsPerSequence; ++r) {
+      if (std::isnan(expected.range[r])) {
+        EXPECT_TRUE(std::isnan(actual.range[r]));
+      } else {
+        EXPECT_EQ(actual.range[r], expected.range[r]);
+      }
+      EXPECT_EQ(actual.intensity[r], expected.intensity[r]);
+      EXPECT_FLOAT_EQ(actual.azimuth[r], expected.azimuth[r]);
+    }
+  }
+}
+
+}  // namespace
+}  // namespace velodyne_puck
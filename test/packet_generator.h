@@ -0,0 +1,72 @@
+#pragma once
+
+#include "packet.h"
+
+#include <cstring>
+
+namespace velodyne_puck {
+
+/// Packets of a sensor spinning at rpm from azimuth 0, or that of
+/// SetAzimuth(), stamped one packet duration apart from stamp_us. From
+/// azimuth 0 the first cut is after one revolution. Every point has a
+/// distance and reflectivity from its position in the stream, some have no
+/// return.
+class PacketGenerator {
+ public:
+  explicit PacketGenerator(int rpm, uint8_t return_mode = kReturnModeStrongest,
+                           uint8_t product_id = 34, uint32_t stamp_us = 0)
+      : return_mode_(return_mode),
+        product_id_(product_id),
+        raw_per_column_(AzimuthResolutionDegree(rpm) / kAzimuthResolution),
+        stamp_us_(stamp_us) {}
+
+  Packet Next() {
+    Packet packet;
+    std::memset(&packet, 0, sizeof(packet));
+    const int step = BlocksPerColumn(return_mode_);
+    for (int b = 0; b < kBlocksPerPacket; b += step) {
+      const uint16_t azimuth =
+          static_cast<int>(raw_azimuth_) % kNumRawAzimuths;
+      raw_azimuth_ += kSequencesPerBlock * raw_per_column_;
+      for (int s = 0; s < step; ++s) {
+        auto& block = packet.blocks[b + s];
+        block.flag = UPPER_BANK;
+        block.azimuth = azimuth;
+        for (auto& seq : block.sequences) {
+          for (auto& point : seq.points) {
+            ++num_points_;
+            const auto d = (num_points_ * 7919) % 40000;
+            point.distance = d < 4000 ? 0 : d;
+            point.reflectivity = num_points_ % 256;
+          }
+        }
+      }
+    }
+    packet.stamp = static_cast<uint32_t>(stamp_us_) % 3600000000u;
+    stamp_us_ += ColumnsPerPacket(return_mode_) * kFiringCycleNs * 1e-3;
+    packet.factory[0] = return_mode_;
+    packet.factory[1] = product_id_;
+    return packet;
+  }
+
+  /// Continue with the next packet at azimuth [deg]
+  void SetAzimuth(double azimuth) {
+    raw_azimuth_ = azimuth / kAzimuthResolution;
+  }
+
+  /// Packets for about revolutions at rpm
+  int PacketsPerRevolutions(double revolutions) const {
+    return static_cast<int>(revolutions * kNumRawAzimuths / raw_per_column_ /
+                            ColumnsPerPacket(return_mode_));
+  }
+
+ private:
+  uint8_t return_mode_;
+  uint8_t product_id_;
+  double raw_per_column_;
+  double raw_azimuth_{0};
+  double stamp_us_;
+  uint32_t num_points_{0};
+};
+
+}  // namespace velodyne_puck